@@ -0,0 +1,89 @@
+#! /bin/sh
+#
+# Sweep the scull benchmark over module geometries and workloads.
+# Meant to run unattended in the QEMU guest (busybox sh is enough):
+# for every scull_quantum/scull_qset pair the module is reloaded with
+# one device, then every pattern, read mix, thread count and I/O size
+# is run against it. One CSV row or JSON object per run goes to $OUT,
+# progress to stderr. Any setting below can be overridden from the
+# environment, e.g. QUANTA="4000 65536" THREADS=1 ./run_bench.sh
+
+here=$(cd "$(dirname "$0")" && pwd)
+
+MODULE=${MODULE:-$here/../scull.ko}
+BENCH=${BENCH:-$here/scull_bench}
+MODPARAMS=${MODPARAMS:-}             # extra insmod arguments, e.g. scull_storage=slab
+QUANTA=${QUANTA:-"4000 16384 65536"}
+QSETS=${QSETS:-"64 1000"}
+PATTERNS=${PATTERNS:-"seq rand"}
+READ_PCTS=${READ_PCTS:-"100 0 70"}  # reads only, writes only, mixed
+THREADS=${THREADS:-"1 4"}
+SIZES=${SIZES:-"4k 64k 1m"}
+SPAN=${SPAN:-64m}
+DURATION=${DURATION:-5}
+FORMAT=${FORMAT:-csv}               # csv or json (one object per line)
+OUT=${OUT:-$here/results.$FORMAT}
+DEV=${DEV:-/dev/scull0}
+
+log() {
+    echo "run_bench: $*" >&2
+}
+
+unload() {
+    grep -qs "^scull " /proc/modules && rmmod scull
+}
+
+# load the module with one device and make sure its node points at it
+load() {
+    insmod "$MODULE" scull_nr_devs=1 scull_quantum="$1" scull_qset="$2" $MODPARAMS || return 1
+    major=$(awk '$2=="scull" {print $1; exit}' /proc/devices)
+    [ -n "$major" ] || return 1
+    # the major is dynamic, a node left from another load may be stale
+    if [ ! -c "$DEV" ] || [ "$(stat -c %t "$DEV")" != "$(printf %x "$major")" ]; then
+        rm -f "$DEV"
+        mknod "$DEV" c "$major" 0 || return 1
+    fi
+}
+
+[ -x "$BENCH" ] || { log "no $BENCH, build it with make -C $here"; exit 1; }
+[ -f "$MODULE" ] || { log "no $MODULE"; exit 1; }
+
+case $FORMAT in
+    csv)  json=""; header="-H" ;;
+    json) json="-j"; header="" ;;
+    *)    log "unknown FORMAT $FORMAT"; exit 1 ;;
+esac
+: > "$OUT"
+
+failed=0
+unload
+for quantum in $QUANTA; do
+    for qset in $QSETS; do
+        label="quantum=$quantum/qset=$qset"
+        if ! load "$quantum" "$qset"; then
+            log "$label: loading the module failed, skipped"
+            failed=$((failed + 1))
+            continue
+        fi
+        for pattern in $PATTERNS; do
+            for pct in $READ_PCTS; do
+                for threads in $THREADS; do
+                    for bs in $SIZES; do
+                        log "$label $pattern read=$pct% threads=$threads bs=$bs"
+                        # fresh data for every run, reads of holes cost nothing
+                        if ! "$BENCH" $json $header -P -p "$pattern" -r "$pct" -t "$threads" \
+                                -b "$bs" -s "$SPAN" -d "$DURATION" -l "$label" "$DEV" >> "$OUT"; then
+                            log "failed"
+                            failed=$((failed + 1))
+                        fi
+                        header=""
+                    done
+                done
+            done
+        done
+        unload
+    done
+done
+
+log "done, results in $OUT, $failed failed"
+[ "$failed" -eq 0 ]
@@ -0,0 +1,359 @@
+/**
+ * Throughput and latency benchmark for scull devices.
+ *
+ * Runs one workload against a device (or any file) with pread/pwrite:
+ * sequential or random offsets, a read/write mix, several threads and
+ * one I/O size, for a fixed time. Every operation is timed into a
+ * log-linear histogram per thread, merged at the end into p50, p99 and
+ * p999. The result is printed as one CSV row or one JSON object, so a
+ * driver script can sweep parameters and collect the lines, see
+ * run_bench.sh. The exit status is 1 if any operation failed or none
+ * completed, so a sweep notices a broken run.
+ *
+ * Build statically for the QEMU guest: make -C bench
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* latencies in ns: 2^SUB_BITS linear buckets per power of two, ~3% error */
+#define SUB_BITS    5
+#define SUB_COUNT   (1 << SUB_BITS)
+#define NR_BUCKETS  ((64 - SUB_BITS + 1) * SUB_COUNT)
+
+enum pattern { PATTERN_SEQ, PATTERN_RAND };
+
+struct options {
+    const char *device;
+    const char *label;          /* free text copied to the output, e.g. the geometry */
+    enum pattern pattern;
+    int read_pct;               /* share of reads, 0 to 100 */
+    int threads;
+    size_t bs;
+    uint64_t span;              /* bytes of the device the offsets fall in */
+    double seconds;
+    int prefill;                /* write the span once before the run */
+    int json;
+    int header;
+};
+
+struct worker {
+    pthread_t thread;
+    const struct options *opt;
+    int id;
+    int fd;
+    uint64_t ops, bytes, errors, max_ns;
+    uint64_t hist[NR_BUCKETS];
+};
+
+static volatile int stop;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int bucket_of(uint64_t ns) {
+    int msb;
+
+    if (ns < SUB_COUNT) {
+        return ns;
+    }
+    msb = 63 - __builtin_clzll(ns);
+    return (msb - SUB_BITS + 1) * SUB_COUNT + ((ns >> (msb - SUB_BITS)) & (SUB_COUNT - 1));
+}
+
+/* the middle of what bucket 'b' counts */
+static uint64_t bucket_value(int b) {
+    int shift = b / SUB_COUNT - 1;
+    uint64_t low;
+
+    if (b < SUB_COUNT) {
+        return b;
+    }
+    low = (uint64_t)(SUB_COUNT + b % SUB_COUNT) << shift;
+    return low + ((1ull << shift) >> 1);
+}
+
+static uint64_t percentile(const uint64_t *hist, uint64_t total, double pct) {
+    uint64_t rank = (uint64_t)(total * pct / 100.0), seen = 0;
+    int b;
+
+    for (b = 0; b < NR_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen > rank) {
+            return bucket_value(b);
+        }
+    }
+    return 0;
+}
+
+/* xorshift64*, one state per thread */
+static uint64_t next_random(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dull;
+}
+
+static void *worker_run(void *arg) {
+    struct worker *w = arg;
+    const struct options *opt = w->opt;
+    uint64_t blocks = opt->span / opt->bs;
+    uint64_t first = blocks * w->id / opt->threads;
+    uint64_t last = blocks * (w->id + 1) / opt->threads;
+    uint64_t seq = first, rnd = 0x9e3779b97f4a7c15ull * (w->id + 1);
+    uint64_t block, start, ns;
+    ssize_t ret;
+    char *buf;
+    int rd;
+
+    if (posix_memalign((void **)&buf, 4096, opt->bs)) {
+        w->errors++;
+        return NULL;
+    }
+    memset(buf, 0x5a + w->id, opt->bs);
+
+    while (!stop) {
+        /* sequential threads stream through a slice each, random ones roam the span */
+        if (opt->pattern == PATTERN_SEQ) {
+            block = seq++;
+            if (seq >= last) {
+                seq = first;
+            }
+        } else {
+            block = next_random(&rnd) % blocks;
+        }
+        rd = opt->read_pct == 100 ||
+             (opt->read_pct > 0 && (int)(next_random(&rnd) % 100) < opt->read_pct);
+
+        start = now_ns();
+        if (rd) {
+            ret = pread(w->fd, buf, opt->bs, block * opt->bs);
+        } else {
+            ret = pwrite(w->fd, buf, opt->bs, block * opt->bs);
+        }
+        ns = now_ns() - start;
+
+        if (ret != (ssize_t)opt->bs) {
+            w->errors++;
+            continue;
+        }
+        w->ops++;
+        w->bytes += ret;
+        w->hist[bucket_of(ns)]++;
+        if (ns > w->max_ns) {
+            w->max_ns = ns;
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+/* reads of a hole are free, give them real data to copy */
+static int prefill(const struct options *opt, int fd) {
+    size_t bs = 1 << 20;
+    uint64_t pos;
+    char *buf = malloc(bs);
+
+    if (!buf) {
+        return -1;
+    }
+    memset(buf, 0xa5, bs);
+    for (pos = 0; pos < opt->span; pos += bs) {
+        size_t len = opt->span - pos < bs ? opt->span - pos : bs;
+
+        if (pwrite(fd, buf, len, pos) != (ssize_t)len) {
+            free(buf);
+            return -1;
+        }
+    }
+    free(buf);
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [options] device\n"
+            "  -p seq|rand   access pattern (seq)\n"
+            "  -r pct        percentage of reads, 0 to 100 (100)\n"
+            "  -t threads    (1)\n"
+            "  -b bytes      I/O size (4096)\n"
+            "  -s bytes      span of the device used (64M)\n"
+            "  -d seconds    run time (5)\n"
+            "  -P            write the span once before running\n"
+            "  -l label      copied to the output, e.g. quantum=4000/qset=1000\n"
+            "  -j            JSON instead of CSV\n"
+            "  -H            print the CSV header first\n"
+            "sizes take k, m and g suffixes\n",
+            prog);
+}
+
+static uint64_t parse_size(const char *s) {
+    char *end;
+    uint64_t v = strtoull(s, &end, 0);
+
+    switch (*end) {
+        case 'g': case 'G': v <<= 10; /* fall through */
+        case 'm': case 'M': v <<= 10; /* fall through */
+        case 'k': case 'K': v <<= 10;
+    }
+    return v;
+}
+
+/* print the merged results, returns non-zero if the run is not to be trusted */
+static int report(const struct options *opt, struct worker *workers, double elapsed) {
+    static uint64_t hist[NR_BUCKETS];
+    uint64_t ops = 0, bytes = 0, errors = 0, max_ns = 0;
+    double mbps, iops, p50, p99, p999;
+    int t, b;
+
+    for (t = 0; t < opt->threads; t++) {
+        ops    += workers[t].ops;
+        bytes  += workers[t].bytes;
+        errors += workers[t].errors;
+        if (workers[t].max_ns > max_ns) {
+            max_ns = workers[t].max_ns;
+        }
+        for (b = 0; b < NR_BUCKETS; b++) {
+            hist[b] += workers[t].hist[b];
+        }
+    }
+    mbps = bytes / elapsed / (1 << 20);
+    iops = ops / elapsed;
+    p50  = percentile(hist, ops, 50.0) / 1000.0;
+    p99  = percentile(hist, ops, 99.0) / 1000.0;
+    p999 = percentile(hist, ops, 99.9) / 1000.0;
+
+    if (opt->json) {
+        printf("{\"label\":\"%s\",\"device\":\"%s\",\"pattern\":\"%s\",\"read_pct\":%d,"
+               "\"threads\":%d,\"bs\":%zu,\"span\":%" PRIu64 ",\"seconds\":%.3f,"
+               "\"ops\":%" PRIu64 ",\"errors\":%" PRIu64 ",\"mb_s\":%.2f,\"iops\":%.0f,"
+               "\"p50_us\":%.2f,\"p99_us\":%.2f,\"p999_us\":%.2f,\"max_us\":%.2f}\n",
+               opt->label, opt->device, opt->pattern == PATTERN_SEQ ? "seq" : "rand",
+               opt->read_pct, opt->threads, opt->bs, opt->span, elapsed, ops, errors,
+               mbps, iops, p50, p99, p999, max_ns / 1000.0);
+    } else {
+        if (opt->header) {
+            printf("label,device,pattern,read_pct,threads,bs,span,seconds,ops,errors,"
+                   "mb_s,iops,p50_us,p99_us,p999_us,max_us\n");
+        }
+        printf("%s,%s,%s,%d,%d,%zu,%" PRIu64 ",%.3f,%" PRIu64 ",%" PRIu64 ",%.2f,%.0f,"
+               "%.2f,%.2f,%.2f,%.2f\n",
+               opt->label, opt->device, opt->pattern == PATTERN_SEQ ? "seq" : "rand",
+               opt->read_pct, opt->threads, opt->bs, opt->span, elapsed, ops, errors,
+               mbps, iops, p50, p99, p999, max_ns / 1000.0);
+    }
+    fflush(stdout);
+
+    if (errors || !ops) {
+        fprintf(stderr, "%s: %" PRIu64 " errors, %" PRIu64 " operations\n", opt->device, errors, ops);
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    struct options opt = {
+        .label    = "",
+        .pattern  = PATTERN_SEQ,
+        .read_pct = 100,
+        .threads  = 1,
+        .bs       = 4096,
+        .span     = 64 << 20,
+        .seconds  = 5,
+    };
+    struct worker *workers;
+    struct timespec run;
+    uint64_t start;
+    int c, t, fd, ret = 0;
+
+    while ((c = getopt(argc, argv, "p:r:t:b:s:d:Pl:jH")) != -1) {
+        switch (c) {
+            case 'p':
+                if (!strcmp(optarg, "seq")) {
+                    opt.pattern = PATTERN_SEQ;
+                } else if (!strcmp(optarg, "rand")) {
+                    opt.pattern = PATTERN_RAND;
+                } else {
+                    usage(argv[0]);
+                    return 2;
+                }
+                break;
+            case 'r': opt.read_pct = atoi(optarg); break;
+            case 't': opt.threads  = atoi(optarg); break;
+            case 'b': opt.bs       = parse_size(optarg); break;
+            case 's': opt.span     = parse_size(optarg); break;
+            case 'd': opt.seconds  = atof(optarg); break;
+            case 'P': opt.prefill  = 1; break;
+            case 'l': opt.label    = optarg; break;
+            case 'j': opt.json     = 1; break;
+            case 'H': opt.header   = 1; break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+    if (optind != argc - 1 || opt.read_pct < 0 || opt.read_pct > 100 || opt.threads <= 0 ||
+        !opt.bs || opt.span / opt.bs < (uint64_t)opt.threads || opt.seconds <= 0) {
+        usage(argv[0]);
+        return 2;
+    }
+    opt.device = argv[optind];
+
+    /* never O_WRONLY, that trims a scull device on open */
+    fd = open(opt.device, O_RDWR);
+    if (fd < 0) {
+        fprintf(stderr, "open %s: %s\n", opt.device, strerror(errno));
+        return 1;
+    }
+    if (opt.prefill && prefill(&opt, fd)) {
+        fprintf(stderr, "prefill %s: %s\n", opt.device, strerror(errno));
+        return 1;
+    }
+
+    workers = calloc(opt.threads, sizeof(*workers));
+    if (!workers) {
+        return 1;
+    }
+    start = now_ns();
+    for (t = 0; t < opt.threads; t++) {
+        workers[t].opt = &opt;
+        workers[t].id  = t;
+        workers[t].fd  = fd;
+        if (pthread_create(&workers[t].thread, NULL, worker_run, &workers[t])) {
+            fprintf(stderr, "pthread_create failed\n");
+            stop = 1;
+            opt.threads = t;
+            ret = 1;
+            break;
+        }
+    }
+    run.tv_sec  = (time_t)opt.seconds;
+    run.tv_nsec = (long)((opt.seconds - run.tv_sec) * 1e9);
+    while (!ret && nanosleep(&run, &run) && errno == EINTR) {
+        ;
+    }
+    stop = 1;
+    for (t = 0; t < opt.threads; t++) {
+        pthread_join(workers[t].thread, NULL);
+    }
+    if (!ret) {
+        ret = report(&opt, workers, (now_ns() - start) / 1e9);
+    }
+
+    free(workers);
+    close(fd);
+    return ret;
+}
@@ -6,10 +6,25 @@
 #include <linux/fs.h>
 #include <linux/cdev.h>
 #include <linux/slab.h>
+#include <linux/mempool.h>
 #include <asm/uaccess.h>
-#include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/xarray.h>
+#include <linux/workqueue.h>
+#include <linux/mm.h>
+#include <linux/uio.h>
+#include <linux/falloc.h>
 #include <linux/moduleparam.h>
+#include <linux/refcount.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/jump_label.h>
+#include <linux/ktime.h>
+#include <linux/percpu_counter.h>
+#include <linux/shrinker.h>
+#include <linux/miscdevice.h>
 #include <linux/ioctl.h> /* needed for the _IOW etc stuff used later */
+#include <linux/rhashtable.h>
 
 
 /* format the print function */
@@ -18,6 +33,7 @@
 
 /* scull module properties */
 #define SCULL_NR_DEVS       3
+#define SCULL_MAX_DEVS      256    /* minors reserved, devices come and go within */
 #define SCULL_MODULE_NAME   "scull"
 
 #ifndef SCULL_QUANTUM
@@ -30,30 +46,320 @@
 
 struct scull_qset {
     void **data;
-    struct scull_qset *next;
+    struct rw_semaphore sem;    /* range lock for the quanta of this set */
+    refcount_t refs;            /* trees holding it: the device and snapshots */
+    unsigned long atime;        /* jiffies of the last access, see scull_compress.c */
+};
+
+/* tag of compressed quanta in their data[] pointer */
+#define SCULL_ZQUANTUM  1UL
+
+static inline bool scull_quantum_compressed(const void *quantum) {
+    return (unsigned long)quantum & SCULL_ZQUANTUM;
+}
+
+/* operational counters, see scull_stats.c */
+enum scull_stat_item {
+    SCULL_STAT_READ_BYTES,
+    SCULL_STAT_WRITE_BYTES,
+    SCULL_STAT_ALLOCS,          /* quantum sets, pointer arrays and quanta */
+    SCULL_STAT_FREES,
+    SCULL_STAT_TRIMS,
+    SCULL_STAT_LOCK_WAITS,      /* device or quantum set lock found taken */
+    SCULL_STAT_ENOMEM,          /* allocations failed on the I/O paths */
+    SCULL_STAT_ZBYTES_IN,       /* quantum bytes compressed */
+    SCULL_STAT_ZBYTES_OUT,      /* what they compressed to */
+    SCULL_STAT_DECOMPRESSIONS,
+    SCULL_STAT_DECOMPRESS_NS,   /* total time spent decompressing */
+    SCULL_STAT_DEDUP_ZERO,      /* all-zero quanta left as holes */
+    SCULL_STAT_DEDUP_MERGED,    /* quanta merged with an identical one */
+    SCULL_NR_STATS,
+};
+
+/* phases of read and write timed into latency histograms */
+enum scull_phase {
+    SCULL_PHASE_LOCK,           /* waiting for the device or quantum set lock */
+    SCULL_PHASE_FOLLOW,         /* looking up or creating the quantum set */
+    SCULL_PHASE_ALLOC,          /* allocating pointer arrays and quanta */
+    SCULL_PHASE_COPY,           /* copying from or to user space */
+    SCULL_PHASE_DECOMPRESS,     /* inflating a compressed quantum */
+    SCULL_NR_PHASES,
+};
+
+/* bucket b counts latencies of [2^(b-1), 2^b) ns, the last one the rest */
+#define SCULL_HIST_BUCKETS  32
+
+struct scull_stats {
+    u64 count[SCULL_NR_STATS];
+    u64 hist[SCULL_NR_PHASES][SCULL_HIST_BUCKETS];
+};
+
+/* bump a counter of this CPU, no shared cache line on the hot path */
+#define scull_stat_add(stats, item, n)  this_cpu_add((stats)->count[item], (n))
+#define scull_stat_inc(stats, item)     this_cpu_inc((stats)->count[item])
+
+/* the histograms cost two clock reads per phase, off unless enabled */
+DECLARE_STATIC_KEY_FALSE(scull_hist_key);
+
+static inline u64 scull_hist_start(void) {
+    return static_branch_unlikely(&scull_hist_key) ? ktime_get_ns() : 0;
+}
+
+static inline void scull_hist_end(struct scull_stats __percpu *stats,
+                                  enum scull_phase phase, u64 start) {
+    int bucket;
+
+    /* started before the key was flipped on */
+    if (!static_branch_unlikely(&scull_hist_key) || !start) {
+        return;
+    }
+    bucket = min(fls64(ktime_get_ns() - start), SCULL_HIST_BUCKETS - 1);
+    this_cpu_inc(stats->hist[phase][bucket]);
+}
+
+/* where a device allocates quanta and quantum sets, see scull_numa.c */
+struct scull_placement {
+    int policy;                 /* SCULL_NUMA_* */
+    int node;                   /* the node of SCULL_NUMA_BIND */
+    int last;                   /* the node last interleaved on */
+};
+
+struct scull_layout;
+struct scull_backing;
+
+/* storage engine, see scull_storage.c */
+struct scull_engine {
+    const char *name;
+    bool mappable;              /* quanta are pages that can be mmapped */
+    void *(*alloc_quantum)(struct scull_layout *layout, gfp_t gfp, int node);
+    void (*free_quantum)(struct scull_layout *layout, void *quantum);
+    int (*setup)(struct scull_layout *layout);
+    void (*release)(struct scull_layout *layout);
+};
+
+/**
+ * Geometry of a tree of quantum sets and the allocators serving it.
+ * Every tree keeps its layout alive, so a tree being freed in the
+ * background still has its caches after the device moved on.
+ */
+struct scull_layout {
+    refcount_t refs;
+    const struct scull_engine *engine;  /* how quanta are allocated */
+    int quantum;                        /* the quantum size */
+    int qset;                           /* the qset size */
+    struct kmem_cache *quantum_cache;   /* NULL for page-sized quanta */
+    struct kmem_cache *qarray_cache;    /* quantum set pointer arrays */
+    mempool_t *quantum_pool;            /* optional reserves, see scull_mempool */
+    mempool_t *qarray_pool;
+    struct scull_stats __percpu *stats; /* of the device owning the layout */
+    struct percpu_counter *usage;       /* quantum bytes of that device */
+    struct scull_placement *placement;  /* and its NUMA placement */
+    struct rhashtable shared;           /* extra owners of shared quanta */
+    spinlock_t share_lock;              /* serializes their updates */
+    atomic_long_t nshared;              /* their sum */
 };
 
 struct scull_dev {
-    struct scull_qset *data;    /* Pointer to first quantum set */
-    int quantum;                /* the current quantum size */
-    int qset;                   /* the current qset size */
+    int index;                  /* its minor */
+    int quantum;                /* geometry it starts with, 0 for the defaults */
+    int qset;
+    atomic_t users;             /* open files and snapshots, see scull_get_dev() */
+    struct xarray *qsets;       /* quantum sets indexed by list item */
+    struct scull_layout *layout;    /* geometry of qsets */
     unsigned long size;         /* amount of data stored here */
     unsigned int access_key;
-    struct cdev cdev;           /* Char device structure */
-    struct mutex mlock;         /* mutual exclusion semaphore */
+    atomic_t vmas;              /* active mappings */
+    int reshape;                /* 1 while reshaping, else the last result */
+    struct scull_stats __percpu *stats;
+    struct delayed_work compress_work;
+    struct percpu_counter usage;    /* bytes held in quanta, see scull_shrink.c */
+    unsigned long limit;        /* cap on usage, 0 for none */
+    int shrink;                 /* SCULL_SHRINK_* policy under memory pressure */
+    struct scull_placement placement;
+    unsigned long shrink_next;  /* item the shrinker resumes at */
+    struct list_head shrink_list;
+    struct delayed_work dedup_work;
+    struct scull_dedup_slot *dedup_seen;    /* quantum hash to where it was seen */
+    unsigned long dedup_next;   /* item the dedup pass resumes at */
+    struct scull_backing *backing;  /* image being restored, see scull_backing.c */
+    struct work_struct restore_work;
+    struct cdev *cdev;          /* Char device structure, outlives us while in use */
+    struct dentry *debugfs[3];  /* its statistics files */
+    struct rw_semaphore sem;    /* shared for I/O, exclusive for structure changes */
+    struct rw_semaphore wsem;   /* shared for writers, exclusive for a reshape */
 };
 
 /* file_operation template */
-ssize_t scull_read (struct file *filp, char __user *buf, size_t count, loff_t *fpos);
-ssize_t scull_write (struct file *filp, const char __user *buf, size_t count, loff_t *fpos);
+ssize_t scull_read_iter(struct kiocb *iocb, struct iov_iter *to);
+ssize_t scull_write_iter(struct kiocb *iocb, struct iov_iter *from);
 int scull_open (struct inode *inode, struct file *filp);
 int scull_release (struct inode *inode, struct file *filp);
 loff_t scull_llseek(struct file *filp, loff_t offset, int whence);
 int scull_trim(struct scull_dev *dev);
+int scull_mmap(struct file *filp, struct vm_area_struct *vma);
+long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+struct scull_qset *scull_follow(struct scull_dev *dev, unsigned long item, gfp_t gfp);
+struct scull_qset *scull_unshare_qset(struct scull_dev *dev, unsigned long item,
+                                      struct scull_qset *dptr, gfp_t gfp);
+int scull_snapshot(struct scull_dev *dev);
+void scull_extend_size(struct scull_dev *dev, unsigned long end);
+ssize_t scull_dev_read(struct scull_dev *dev, struct kiocb *iocb, struct iov_iter *to);
+ssize_t scull_dev_write(struct scull_dev *dev, struct kiocb *iocb, struct iov_iter *from);
+long scull_dev_fallocate(struct scull_dev *dev, int mode, loff_t offset, loff_t len);
+
+/* block device front end, see scull_block.c */
+int scull_block_init(void);
+void scull_block_exit(void);
+
+/* devices, see scull_basic.c */
+struct scull_dev *scull_get_dev(int index);
+void scull_put_dev(struct scull_dev *dev);
+
+/* storage allocation, see scull_storage.c */
+int scull_storage_init(void);
+void scull_storage_exit(void);
+int scull_setup_storage(struct scull_dev *dev);
+void scull_release_storage(struct scull_dev *dev);
+struct scull_qset *scull_alloc_qset(struct scull_layout *layout, gfp_t gfp);
+void scull_free_qset(struct scull_qset *qs_data);
+void **scull_alloc_qarray(struct scull_layout *layout, gfp_t gfp);
+void scull_free_qarray(struct scull_layout *layout, void **data);
+void *scull_alloc_quantum(struct scull_layout *layout, gfp_t gfp);
+void scull_free_quantum(struct scull_layout *layout, void *quantum);
+size_t scull_quantum_size(struct scull_layout *layout, const void *quantum);
+struct scull_layout *scull_alloc_layout(struct scull_dev *dev, const struct scull_engine *engine,
+                                        int quantum, int qset);
+void scull_get_layout(struct scull_layout *layout);
+void scull_put_layout(struct scull_layout *layout);
+int scull_share_quantum(struct scull_layout *layout, void *quantum, gfp_t gfp);
+bool scull_quantum_shared(struct scull_layout *layout, void *quantum);
+void scull_put_quantum(struct scull_layout *layout, struct scull_qset *dptr, int i);
+int scull_unshare_quantum(struct scull_layout *layout, struct scull_qset *dptr, int i, gfp_t gfp);
+void scull_put_qset(struct scull_layout *layout, struct scull_qset *dptr);
+bool scull_valid_geometry(const struct scull_engine *engine, int quantum, int qset);
+bool scull_valid_defaults(int quantum, int qset);
+int scull_default_quantum(void);
+int scull_dev_quantum(struct scull_dev *dev);
+int scull_dev_qset(struct scull_dev *dev);
+void scull_free_qsets(struct scull_layout *layout, struct xarray *qsets,
+                      unsigned long first, unsigned long last);
+void scull_free_qsets_async(struct scull_layout *layout, struct xarray *qsets,
+                            unsigned long nitems);
+int scull_reshape(struct scull_dev *dev, int quantum, int qset);
+
+/* compression of cold quanta, see scull_compress.c */
+int scull_compress_init(void);
+void scull_compress_exit(void);
+void scull_compress_start(struct scull_dev *dev);
+void scull_compress_stop(struct scull_dev *dev);
+bool scull_can_compress(void);
+int scull_decompress_quantum(struct scull_layout *layout, const void *quantum, void *plain);
+void *scull_inflate_quantum(struct scull_layout *layout, const void *quantum, gfp_t gfp);
+size_t scull_deflate_quantum(struct scull_layout *layout, struct scull_qset *dptr,
+                             int i, void *buf, gfp_t gfp);
+size_t scull_zquantum_size(const void *quantum);
+void scull_free_zquantum(void *quantum);
+
+/* deduplication, see scull_dedup.c */
+enum scull_dedup_mode {
+    SCULL_DEDUP_OFF,
+    SCULL_DEDUP_ZERO,           /* all-zero quanta are not stored */
+    SCULL_DEDUP_HASH,           /* and identical quanta are merged */
+};
+
+int scull_dedup_init(void);
+void scull_dedup_start(struct scull_dev *dev);
+void scull_dedup_stop(struct scull_dev *dev);
+void scull_dedup_zero(struct scull_dev *dev, struct scull_qset *dptr, int i,
+                      int offset, size_t len, bool fresh);
+
+/* NUMA placement, see scull_numa.c */
+int scull_numa_init(void);
+void scull_numa_setup(struct scull_dev *dev);
+int scull_set_placement(struct scull_dev *dev, int policy, int node);
+int scull_place(struct scull_placement *placement, gfp_t *gfp);
+int scull_numa_usage(struct scull_dev *dev, u64 *bytes);
+
+/* persistence, see scull_backing.c */
+void scull_backing_setup(struct scull_dev *dev);
+void scull_backing_release(struct scull_dev *dev);
+int scull_backing_restore(struct scull_dev *dev, int index);
+int scull_backing_dump(struct scull_dev *dev, int index);
+int scull_backing_wait(struct scull_dev *dev);
+void scull_backing_drop(struct scull_dev *dev);
+ssize_t scull_backing_read(struct scull_dev *dev, unsigned long n, int offset,
+                           size_t len, struct iov_iter *to, bool nowait);
+void scull_backing_dirty(struct scull_dev *dev, unsigned long n);
+bool scull_backing_evict(struct scull_dev *dev, unsigned long n);
+int scull_backing_fill(struct scull_dev *dev, struct scull_qset *dptr, int i,
+                       unsigned long n, gfp_t gfp);
+
+/* memory caps and the shrinker, see scull_shrink.c */
+int scull_shrink_init(void);
+void scull_shrink_exit(void);
+int scull_shrink_add_dev(struct scull_dev *dev);
+void scull_shrink_del_dev(struct scull_dev *dev);
+bool scull_may_grow(struct scull_dev *dev);
+int scull_set_shrink(struct scull_dev *dev, unsigned long policy);
+
+/* debugfs statistics, see scull_stats.c */
+void scull_stats_init(void);
+void scull_stats_exit(void);
+void scull_stats_add_dev(struct scull_dev *dev, int index);
+void scull_stats_del_dev(struct scull_dev *dev);
+void scull_drain_storage(void);
+
+/* storage core microbenchmarks, see scull_microbench.c */
+struct scull_microbench {
+    long nquanta;
+    u64 alloc_ns, follow_ns;    /* per quantum, per lookup */
+    u64 free_us, trim_us;
+};
+
+void scull_microbench_init(struct dentry *dir);
+struct scull_dev *scull_scratch_dev(void);
+long scull_scratch_fill(struct scull_dev *dev, unsigned long size);
+void scull_scratch_free(struct scull_dev *dev);
+int scull_microbench_run(struct scull_dev *dev, unsigned long size, struct scull_microbench *res);
 
 extern int scull_nr_devs;
+extern int scull_max_devs;
+extern int scull_blk_nr;
+extern int scull_blk_mb;
+extern int scull_blk_depth;
 extern int scull_quantum;
 extern int scull_qset;
+extern int scull_mempool;
+extern char *scull_storage;
+extern int scull_page_order;
+extern char *scull_compress;
+extern int scull_compress_ms;
+extern char *scull_dedup;
+extern int scull_dedup_ms;
+extern int scull_dedup_mode;
+extern char *scull_backing;
+extern int scull_restore_eager;
+extern char *scull_numa;
+extern int scull_numa_node;
+extern unsigned long scull_dev_limit;
+extern unsigned long scull_total_limit;
+extern char *scull_shrink;
+extern int scull_default_shrink;
+extern struct percpu_counter scull_usage;
+extern const struct scull_engine *scull_default_engine;
+
+/* note an access to 'dptr', for the cold quanta compressor */
+static inline void scull_touch_qset(struct scull_qset *dptr) {
+    if (scull_compress_ms > 0) {
+        WRITE_ONCE(dptr->atime, jiffies);
+    }
+}
+
+/* charge quantum memory to the device owning 'layout', negative to uncharge */
+static inline void scull_account(struct scull_layout *layout, s64 bytes) {
+    percpu_counter_add(layout->usage, bytes);
+    percpu_counter_add(&scull_usage, bytes);
+}
 
 /* Use 'k' as magic number */
 #define SCULL_IOC_MAGIC  'k'
@@ -89,9 +395,94 @@ extern int scull_qset;
  */
 #define SCULL_P_IOCTSIZE _IO(SCULL_IOC_MAGIC,   13)
 #define SCULL_P_IOCQSIZE _IO(SCULL_IOC_MAGIC,   14)
-/* ... more to come */
 
-#define SCULL_IOC_MAXNR 14
+/*
+ * Re-pack the data of a device into a new quantum and qset size in
+ * the background; the query returns 1 while that is running, then
+ * 0 or the negative error it ended with.
+ */
+struct scull_geometry {
+    int quantum;
+    int qset;
+};
+
+#define SCULL_IOCRESHAPE  _IOW(SCULL_IOC_MAGIC, 15, struct scull_geometry)
+#define SCULL_IOCQRESHAPE _IO(SCULL_IOC_MAGIC,  16)
+
+/* returns a read-only file descriptor on a point-in-time copy */
+#define SCULL_IOCSNAPSHOT _IO(SCULL_IOC_MAGIC,  17)
+
+/*
+ * Cap on the memory a device holds in quanta, in bytes with 0 for
+ * none; writes past it fail with ENOSPC. And what the shrinker may do
+ * to the quanta of a device when the system runs short of memory:
+ * nothing, compress them, or drop those it can rebuild: quanta of
+ * zeros, and those still as the image being restored has them.
+ */
+enum scull_shrink_policy {
+    SCULL_SHRINK_NONE,
+    SCULL_SHRINK_COMPRESS,
+    SCULL_SHRINK_DROP,
+};
+
+#define SCULL_IOCTLIMIT   _IO(SCULL_IOC_MAGIC,  18)
+#define SCULL_IOCQLIMIT   _IO(SCULL_IOC_MAGIC,  19)
+#define SCULL_IOCTSHRINK  _IO(SCULL_IOC_MAGIC,  20)
+#define SCULL_IOCQSHRINK  _IO(SCULL_IOC_MAGIC,  21)
+
+/*
+ * NUMA placement of what a device allocates from then on: on the node
+ * of the writing CPU, round-robin over the nodes with memory, or only
+ * on 'node'. Data already stored stays where it is.
+ */
+enum scull_numa_policy {
+    SCULL_NUMA_LOCAL,
+    SCULL_NUMA_INTERLEAVE,
+    SCULL_NUMA_BIND,
+};
+
+struct scull_numa {
+    int policy;
+    int node;
+};
+
+#define SCULL_IOCSNUMA    _IOW(SCULL_IOC_MAGIC, 22, struct scull_numa)
+#define SCULL_IOCGNUMA    _IOR(SCULL_IOC_MAGIC, 23, struct scull_numa)
+
+/* write the device to its backing file, see scull_backing */
+#define SCULL_IOCDUMP     _IO(SCULL_IOC_MAGIC,  24)
+
+/*
+ * fallocate(2) on a range of the device: the VFS only passes it on to
+ * regular files and block devices, /dev/scullN gets ENODEV there. The
+ * mode takes FALLOC_FL_KEEP_SIZE, FALLOC_FL_PUNCH_HOLE and
+ * FALLOC_FL_ZERO_RANGE.
+ */
+struct scull_fallocate {
+    long long offset;
+    long long len;
+    int mode;
+    int pad;
+};
+
+#define SCULL_IOCFALLOCATE _IOW(SCULL_IOC_MAGIC, 25, struct scull_fallocate)
+
+#define SCULL_IOC_MAXNR 25
+
+/*
+ * ioctls of /dev/scull-control. Add creates a device, on the given
+ * minor or on any free one with -1, and with its own quantum and qset
+ * size (0 for the module defaults); remove takes the minor of a device
+ * nobody has open. Both return the minor.
+ */
+struct scull_ctl {
+    int minor;
+    int quantum;
+    int qset;
+};
+
+#define SCULL_CTL_ADD     _IOW(SCULL_IOC_MAGIC, 32, struct scull_ctl)
+#define SCULL_CTL_REMOVE  _IO(SCULL_IOC_MAGIC,  33)
 
 
 #endif  //!__SCULL__H__
\ No newline at end of file
@@ -0,0 +1,514 @@
+#include "scull.h"
+#include <linux/namei.h>
+
+char *scull_backing = "";
+int scull_restore_eager;
+
+/**
+ * File-backed persistence. With scull_backing set to a path prefix,
+ * device N is dumped to <prefix>N on unload or on SCULL_IOCDUMP, and
+ * restored from it when the module loads.
+ *
+ * The image is a header, the quanta holding data in ascending order
+ * with holes skipped, then the quantum number of each of them:
+ *
+ *     struct scull_image | quantum 0 | ... | quantum nr-1 | __le64 map[nr]
+ *
+ * The header carries the geometry the device had, the restored device
+ * takes it up whatever the module parameters say.
+ *
+ * A restore only reads the header and the map, so the device is
+ * usable right away. Until a background work has copied every quantum
+ * in, holes the file has data for are read straight from it, and a
+ * writer reads the quantum in before modifying it. A quantum read in
+ * keeps its place in the index until it is written to, so that the
+ * shrinker can drop it and have it read in again. Whatever needs the
+ * whole device at once (fallocate, SEEK_DATA/SEEK_HOLE, mmap,
+ * reshaping, snapshots, dumping) waits for the restore to complete.
+ * A trim throws the rest of the image away, and so does a restore that
+ * fails, the device then has holes there rather than staying stuck.
+ * scull_restore_eager makes the load wait for the copy instead.
+ */
+#define SCULL_IMAGE_MAGIC   0x4c554353  /* "SCUL" */
+#define SCULL_IMAGE_VERSION 2
+#define SCULL_RESTORE_BATCH 1024        /* quanta per hold of the device lock */
+#define SCULL_IMAGE_PENDING XA_MARK_0   /* index entry not read in yet */
+
+struct scull_image {
+    __le32 magic;
+    __le32 version;
+    __le32 quantum;
+    __le32 qset;
+    __le64 size;                /* of the device */
+    __le64 nr;                  /* quanta stored */
+};
+
+struct scull_backing {
+    struct file *file;
+    struct xarray index;        /* quantum number to its slot in the file */
+    unsigned long nr;
+    ktime_t start;
+};
+
+static char *scull_backing_path(int index) {
+    return kasprintf(GFP_KERNEL, "%s%d", scull_backing, index);
+}
+
+static void scull_backing_free(struct scull_backing *b) {
+    xa_destroy(&b->index);
+    filp_close(b->file, NULL);
+    kfree(b);
+}
+
+static loff_t scull_backing_pos(struct scull_dev *dev, void *entry) {
+    return sizeof(struct scull_image) + (loff_t)xa_to_value(entry) * dev->layout->quantum;
+}
+
+/**
+ * Read up to 'len' bytes at 'offset' of the hole at quantum number 'n'
+ * from the backing file into 'to'. Returns -ENOENT if the file has
+ * nothing there. The device lock must be held.
+ */
+ssize_t scull_backing_read(struct scull_dev *dev, unsigned long n, int offset,
+                           size_t len, struct iov_iter *to, bool nowait) {
+    void *entry = xa_load(&dev->backing->index, n);
+    size_t count = iov_iter_count(to);
+    loff_t pos;
+    ssize_t ret;
+
+    if (!entry) {
+        return -ENOENT;
+    }
+    if (nowait) {
+        return -EAGAIN;
+    }
+    pos = scull_backing_pos(dev, entry) + offset;
+    iov_iter_truncate(to, len);
+    ret = vfs_iter_read(dev->backing->file, to, &pos, 0);
+    iov_iter_reexpand(to, count - max_t(ssize_t, ret, 0));
+    return ret;
+}
+
+/**
+ * Read the data the backing file has for hole 'i' of 'dptr', locked
+ * for writing, into a new quantum. 'n' is its quantum number. Returns
+ * 1 if it did, 0 if there is none. A writer must call
+ * scull_backing_dirty() before modifying it.
+ */
+int scull_backing_fill(struct scull_dev *dev, struct scull_qset *dptr, int i,
+                       unsigned long n, gfp_t gfp) {
+    int quantum = dev->layout->quantum;
+    void *entry = xa_load(&dev->backing->index, n);
+    loff_t pos;
+    ssize_t ret;
+
+    if (!entry) {
+        return 0;
+    }
+    if (!gfpflags_allow_blocking(gfp)) {
+        return -EAGAIN;
+    }
+    dptr->data[i] = scull_alloc_quantum(dev->layout, gfp);
+    if (!dptr->data[i]) {
+        scull_stat_inc(dev->stats, SCULL_STAT_ENOMEM);
+        return -ENOMEM;
+    }
+    pos = scull_backing_pos(dev, entry);
+    ret = kernel_read(dev->backing->file, dptr->data[i], quantum, &pos);
+    if (ret != quantum) {
+        scull_free_quantum(dev->layout, dptr->data[i]);
+        dptr->data[i] = NULL;
+        return ret < 0 ? ret : -EIO;
+    }
+    xa_clear_mark(&dev->backing->index, n, SCULL_IMAGE_PENDING);
+    return 1;
+}
+
+/* quantum number 'n', locked for writing, no longer matches the file */
+void scull_backing_dirty(struct scull_dev *dev, unsigned long n) {
+    if (dev->backing) {
+        xa_erase(&dev->backing->index, n);
+    }
+}
+
+/**
+ * Whether quantum number 'n', locked for writing, is as the backing
+ * file has it. If so it is marked to be read in again, and the caller
+ * may drop it.
+ */
+bool scull_backing_evict(struct scull_dev *dev, unsigned long n) {
+    if (!dev->backing || !xa_load(&dev->backing->index, n)) {
+        return false;
+    }
+    xa_set_mark(&dev->backing->index, n, SCULL_IMAGE_PENDING);
+    return true;
+}
+
+/* copy in up to a batch of quanta, 1 once the image is all in */
+static int scull_restore_batch(struct scull_dev *dev) {
+    int qset = dev->layout->qset, nr = 0, ret = 0;
+    struct scull_qset *dptr;
+    unsigned long n;
+    void *entry;
+
+    xa_for_each_marked(&dev->backing->index, n, entry, SCULL_IMAGE_PENDING) {
+        dptr = scull_follow(dev, n / qset, GFP_KERNEL);
+        if (!dptr) {
+            return -ENOMEM;
+        }
+        down_write(&dptr->sem);
+        if (!dptr->data) {
+            dptr->data = scull_alloc_qarray(dev->layout, GFP_KERNEL);
+        }
+        if (!dptr->data) {
+            ret = -ENOMEM;
+        } else if (dptr->data[n % qset]) {
+            /* never, but don't spin on it */
+            xa_clear_mark(&dev->backing->index, n, SCULL_IMAGE_PENDING);
+        } else {
+            ret = scull_backing_fill(dev, dptr, n % qset, n, GFP_KERNEL);
+        }
+        up_write(&dptr->sem);
+        if (ret < 0) {
+            return ret;
+        }
+        if (++nr == SCULL_RESTORE_BATCH) {
+            break;
+        }
+        cond_resched();
+    }
+    return !xa_marked(&dev->backing->index, SCULL_IMAGE_PENDING);
+}
+
+static void scull_restore_work(struct work_struct *work) {
+    struct scull_dev *dev = container_of(work, struct scull_dev, restore_work);
+    struct scull_backing *b;
+    int ret;
+
+    /* trims get their turn between batches */
+again:
+    do {
+        down_read(&dev->sem);
+        b = dev->backing;
+        ret = b ? scull_restore_batch(dev) : -ENOENT;
+        up_read(&dev->sem);
+    } while (ret == 0);
+
+    if (ret == -ENOENT) {
+        return; /* trimmed meanwhile */
+    }
+
+    down_write(&dev->sem);
+    /* the shrinker dropped some of it again meanwhile */
+    if (dev->backing == b && ret > 0 && xa_marked(&b->index, SCULL_IMAGE_PENDING)) {
+        up_write(&dev->sem);
+        goto again;
+    }
+    if (dev->backing == b) {
+        if (ret < 0) {
+            pr_err("restore of scull%d stopped: %d, the rest of the image is dropped\n",
+                   dev->index, ret);
+        } else {
+            pr_info("restored %lu quanta in %lld ms\n", b->nr,
+                    ktime_ms_delta(ktime_get(), b->start));
+        }
+        dev->backing = NULL;
+        scull_backing_free(b);
+    }
+    up_write(&dev->sem);
+}
+
+/**
+ * Wait for the restore of 'dev' to be over, done or dropped. Must be
+ * called without the device locks.
+ */
+int scull_backing_wait(struct scull_dev *dev) {
+    flush_work(&dev->restore_work);
+    return READ_ONCE(dev->backing) ? -EIO : 0;
+}
+
+/* the device lock must be held for writing */
+void scull_backing_drop(struct scull_dev *dev) {
+    if (dev->backing) {
+        scull_backing_free(dev->backing);
+        dev->backing = NULL;
+    }
+}
+
+static int scull_restore_map(struct scull_backing *b, loff_t pos) {
+    __le64 *map;
+    unsigned long k, i, nr;
+    ssize_t len;
+    int ret = 0;
+
+    map = kmalloc_array(SCULL_RESTORE_BATCH, sizeof(*map), GFP_KERNEL);
+    if (!map) {
+        return -ENOMEM;
+    }
+    for (k = 0; k < b->nr && !ret; k += nr) {
+        nr  = min_t(unsigned long, b->nr - k, SCULL_RESTORE_BATCH);
+        len = kernel_read(b->file, map, nr * sizeof(*map), &pos);
+        if (len != nr * sizeof(*map)) {
+            ret = len < 0 ? len : -EIO;
+            break;
+        }
+        for (i = 0; i < nr; i++) {
+            ret = xa_err(xa_store(&b->index, le64_to_cpu(map[i]), xa_mk_value(k + i), GFP_KERNEL));
+            if (ret) {
+                break;
+            }
+            xa_set_mark(&b->index, le64_to_cpu(map[i]), SCULL_IMAGE_PENDING);
+        }
+    }
+    kfree(map);
+    return ret;
+}
+
+/**
+ * Bring back the image of device 'index', if there is one, into the
+ * fresh 'dev' before it goes live. The device takes the geometry of
+ * the image.
+ */
+int scull_backing_restore(struct scull_dev *dev, int index) {
+    struct scull_layout *layout;
+    struct scull_backing *b;
+    struct scull_image hdr;
+    loff_t pos = 0;
+    char *path;
+    int quantum, qset, ret;
+
+    if (!*scull_backing) {
+        return 0;
+    }
+    path = scull_backing_path(index);
+    if (!path) {
+        return -ENOMEM;
+    }
+    b = kzalloc(sizeof(*b), GFP_KERNEL);
+    if (!b) {
+        kfree(path);
+        return -ENOMEM;
+    }
+    b->start = ktime_get();
+    xa_init(&b->index);
+    b->file = filp_open(path, O_RDONLY | O_LARGEFILE, 0);
+    kfree(path);
+    if (IS_ERR(b->file)) {
+        ret = PTR_ERR(b->file);
+        kfree(b);
+        return ret == -ENOENT ? 0 : ret;
+    }
+
+    ret = kernel_read(b->file, &hdr, sizeof(hdr), &pos);
+    if (ret != sizeof(hdr) || le32_to_cpu(hdr.magic) != SCULL_IMAGE_MAGIC ||
+        le32_to_cpu(hdr.version) != SCULL_IMAGE_VERSION) {
+        ret = -EINVAL;
+        goto fail;
+    }
+    quantum = le32_to_cpu(hdr.quantum);
+    qset    = le32_to_cpu(hdr.qset);
+    b->nr   = le64_to_cpu(hdr.nr);
+    if (!scull_valid_geometry(scull_default_engine, quantum, qset) ||
+        b->nr > (LLONG_MAX - sizeof(hdr)) / (quantum + sizeof(__le64)) ||
+        i_size_read(file_inode(b->file)) <
+        sizeof(hdr) + (loff_t)b->nr * (quantum + sizeof(__le64))) {
+        ret = -EINVAL;
+        goto fail;
+    }
+    ret = scull_restore_map(b, sizeof(hdr) + (loff_t)b->nr * quantum);
+    if (ret) {
+        goto fail;
+    }
+
+    if (quantum != dev->layout->quantum || qset != dev->layout->qset) {
+        layout = scull_alloc_layout(dev, scull_default_engine, quantum, qset);
+        if (!layout) {
+            ret = -ENOMEM;
+            goto fail;
+        }
+        scull_put_layout(dev->layout);
+        dev->layout = layout;
+    }
+    dev->size    = le64_to_cpu(hdr.size);
+    dev->backing = b;
+    pr_info("scull%d usable after %lld us, %lu quanta to restore\n",
+            index, ktime_us_delta(ktime_get(), b->start), b->nr);
+
+    if (scull_restore_eager) {
+        scull_restore_work(&dev->restore_work);
+    } else {
+        queue_work(system_unbound_wq, &dev->restore_work);
+    }
+    return 0;
+
+fail:
+    pr_err("Bad image of scull%d: %d\n", index, ret);
+    scull_backing_free(b);
+    return ret;
+}
+
+/**
+ * Move the image just written to 'file' over 'path', in the same
+ * directory, so that a crash leaves either image whole.
+ */
+static int scull_backing_rename(struct file *file, const char *path) {
+    struct dentry *old = file->f_path.dentry, *dir, *new;
+    const char *name = kbasename(path);
+    int ret;
+
+    ret = mnt_want_write(file->f_path.mnt);
+    if (ret) {
+        return ret;
+    }
+    dir = dget_parent(old);
+    lock_rename(dir, dir);
+    new = lookup_one_len(name, dir, strlen(name));
+    if (IS_ERR(new)) {
+        ret = PTR_ERR(new);
+    } else {
+        /* unless someone moved the temporary file away meanwhile */
+        ret = old->d_parent == dir ?
+              vfs_rename(d_inode(dir), old, d_inode(dir), new, NULL, 0) : -ENOENT;
+        dput(new);
+    }
+    unlock_rename(dir, dir);
+    dput(dir);
+    mnt_drop_write(file->f_path.mnt);
+    return ret;
+}
+
+/**
+ * Write the data of 'dev' to the image of device 'index'. Writers are
+ * held off meanwhile. The image is written to <path>.tmp, synced and
+ * only then renamed over the old one; a dump cut short leaves the old
+ * image alone. The header still goes last.
+ */
+int scull_backing_dump(struct scull_dev *dev, int index) {
+    struct scull_image hdr = { 0 };
+    struct scull_layout *layout;
+    struct scull_qset *dptr;
+    struct file *file;
+    unsigned long item, nr = 0, k = 0;
+    __le64 *map;
+    void *src, *plain;
+    loff_t pos = sizeof(hdr), qpos;
+    char *path, *tmp;
+    ssize_t len;
+    int i, ret = 0;
+
+    if (!*scull_backing) {
+        return -EINVAL;
+    }
+    ret = scull_backing_wait(dev);
+    if (ret) {
+        return ret;
+    }
+    path = scull_backing_path(index);
+    if (!path) {
+        return -ENOMEM;
+    }
+    tmp = kasprintf(GFP_KERNEL, "%s.tmp", path);
+    if (!tmp) {
+        kfree(path);
+        return -ENOMEM;
+    }
+    file = filp_open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0600);
+    kfree(tmp);
+    if (IS_ERR(file)) {
+        kfree(path);
+        return PTR_ERR(file);
+    }
+
+    down_write(&dev->wsem);
+    down_read(&dev->sem);
+    layout = dev->layout;
+
+    /* sizing pass, the shrinker may only make it smaller */
+    xa_for_each(dev->qsets, item, dptr) {
+        down_read(&dptr->sem);
+        for (i = 0; dptr->data && i < layout->qset; i++) {
+            nr += dptr->data[i] != NULL;
+        }
+        up_read(&dptr->sem);
+    }
+    map = kvmalloc_array(nr, sizeof(*map), GFP_KERNEL);
+    if (!map) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    xa_for_each(dev->qsets, item, dptr) {
+        down_read(&dptr->sem);
+        for (i = 0; dptr->data && i < layout->qset && k < nr && !ret; i++) {
+            qpos = ((loff_t)item * layout->qset + i) * layout->quantum;
+            src  = dptr->data[i];
+            if (!src || qpos >= dev->size) {
+                continue;
+            }
+            plain = NULL;
+            if (scull_quantum_compressed(src)) {
+                src = plain = scull_inflate_quantum(layout, src, GFP_KERNEL);
+                if (!plain) {
+                    ret = -ENOMEM;
+                    break;
+                }
+            }
+            len = kernel_write(file, src, layout->quantum, &pos);
+            if (len != layout->quantum) {
+                ret = len < 0 ? len : -EIO;
+            }
+            map[k++] = cpu_to_le64((u64)item * layout->qset + i);
+            kvfree(plain);
+        }
+        up_read(&dptr->sem);
+        if (ret) {
+            break;
+        }
+        cond_resched();
+    }
+
+    if (!ret) {
+        len = kernel_write(file, map, k * sizeof(*map), &pos);
+        if (len != k * sizeof(*map)) {
+            ret = len < 0 ? len : -EIO;
+        }
+    }
+    if (!ret) {
+        hdr.magic   = cpu_to_le32(SCULL_IMAGE_MAGIC);
+        hdr.version = cpu_to_le32(SCULL_IMAGE_VERSION);
+        hdr.quantum = cpu_to_le32(layout->quantum);
+        hdr.qset    = cpu_to_le32(layout->qset);
+        hdr.size    = cpu_to_le64(dev->size);
+        hdr.nr      = cpu_to_le64(k);
+        pos = 0;
+        len = kernel_write(file, &hdr, sizeof(hdr), &pos);
+        if (len != sizeof(hdr)) {
+            ret = len < 0 ? len : -EIO;
+        }
+    }
+    kvfree(map);
+
+out:
+    up_read(&dev->sem);
+    up_write(&dev->wsem);
+    if (!ret) {
+        ret = vfs_fsync(file, 0);
+    }
+    if (!ret) {
+        ret = scull_backing_rename(file, path);
+    }
+    filp_close(file, NULL);
+    kfree(path);
+    pr_info("dump of scull%d, %lu quanta: %d\n", index, k, ret);
+    return ret;
+}
+
+void scull_backing_setup(struct scull_dev *dev) {
+    dev->backing = NULL;
+    INIT_WORK(&dev->restore_work, scull_restore_work);
+}
+
+void scull_backing_release(struct scull_dev *dev) {
+    flush_work(&dev->restore_work);
+    scull_backing_drop(dev);
+}
@@ -2,32 +2,293 @@
 
 /* user input parameters */
 module_param(scull_nr_devs, int, S_IRUGO);
+module_param(scull_max_devs, int, S_IRUGO);
+MODULE_PARM_DESC(scull_max_devs, "Minors reserved for devices created at load or through scull-control");
 module_param(scull_quantum, int, S_IRUGO);
 module_param(scull_qset, int, S_IRUGO);
+module_param(scull_blk_nr, int, S_IRUGO);
+MODULE_PARM_DESC(scull_blk_nr, "Block devices scullbN to create, 0 (default) for none");
+module_param(scull_blk_mb, int, S_IRUGO);
+MODULE_PARM_DESC(scull_blk_mb, "Size of each block device in MiB (default 64)");
+module_param(scull_blk_depth, int, S_IRUGO);
+MODULE_PARM_DESC(scull_blk_depth, "Tags of each hardware queue of the block devices (default 128)");
+module_param(scull_storage, charp, S_IRUGO);
+MODULE_PARM_DESC(scull_storage, "Quantum storage engine: slab (default) or page");
+module_param(scull_page_order, int, S_IRUGO);
+MODULE_PARM_DESC(scull_page_order, "Page engine quantum size as a page order");
+module_param(scull_mempool, int, S_IRUGO);
+MODULE_PARM_DESC(scull_mempool, "Quanta kept in reserve per device for writes under memory pressure");
+module_param(scull_compress, charp, S_IRUGO);
+MODULE_PARM_DESC(scull_compress, "Compression algorithm for cold quanta (default lz4)");
+module_param(scull_compress_ms, int, S_IRUGO);
+MODULE_PARM_DESC(scull_compress_ms, "Compress quanta untouched for this many ms, 0 (default) disables");
+module_param(scull_dedup, charp, S_IRUGO);
+MODULE_PARM_DESC(scull_dedup, "Deduplicate quanta: off (default), zero (all-zero quanta) or hash (and identical ones)");
+module_param(scull_dedup_ms, int, S_IRUGO);
+MODULE_PARM_DESC(scull_dedup_ms, "Interval in ms of the hash dedup pass (default 1000)");
+module_param(scull_backing, charp, S_IRUGO);
+MODULE_PARM_DESC(scull_backing, "Path prefix of the device images, empty (default) for none");
+module_param(scull_restore_eager, int, S_IRUGO);
+MODULE_PARM_DESC(scull_restore_eager, "Load images entirely before the devices go live");
+module_param(scull_numa, charp, S_IRUGO);
+MODULE_PARM_DESC(scull_numa, "NUMA placement of quanta: local (default), interleave or bind");
+module_param(scull_numa_node, int, S_IRUGO);
+MODULE_PARM_DESC(scull_numa_node, "Node quanta are bound to with scull_numa=bind");
+module_param(scull_dev_limit, ulong, S_IRUGO);
+MODULE_PARM_DESC(scull_dev_limit, "Bytes of quanta a device may hold, 0 (default) for no limit");
+module_param(scull_total_limit, ulong, S_IRUGO);
+MODULE_PARM_DESC(scull_total_limit, "Bytes of quanta all devices together may hold, 0 (default) for no limit");
+module_param(scull_shrink, charp, S_IRUGO);
+MODULE_PARM_DESC(scull_shrink, "What reclaim may do to quanta: none (default), compress or drop");
 
 /* scull device essential property */
 static dev_t scull_dev_num;
-static struct scull_dev *scull_devs;
+static struct class *scull_class;
+
+/**
+ * Live devices by minor. The minors are reserved up front, a device
+ * only costs memory once created, at load or through scull-control.
+ * Creating and removing devices is serialized by scull_devs_lock;
+ * open() only takes the xarray lock to look a device up.
+ */
+static DEFINE_XARRAY_ALLOC(scull_devs);
+static DEFINE_MUTEX(scull_devs_lock);
 
 static const struct file_operations scull_fops = {
-    .owner   = THIS_MODULE,
-    .read    = scull_read,
-    .write   = scull_write,
-    .open    = scull_open,
-    .llseek  = scull_llseek,
-    .release = scull_release,
+    .owner          = THIS_MODULE,
+    .read_iter      = scull_read_iter,
+    .write_iter     = scull_write_iter,
+    .open           = scull_open,
+    .llseek         = scull_llseek,
+    .unlocked_ioctl = scull_ioctl,
+    .compat_ioctl   = compat_ptr_ioctl,
+    .mmap           = scull_mmap,
+    .splice_read    = generic_file_splice_read,
+    .splice_write   = iter_file_splice_write,
+    .release        = scull_release,
+};
+
+/* the device of minor 'index' with a user more, NULL if there is none */
+struct scull_dev *scull_get_dev(int index) {
+    struct scull_dev *dev;
+
+    xa_lock(&scull_devs);
+    dev = xa_load(&scull_devs, index);
+    if (dev) {
+        atomic_inc(&dev->users);
+    }
+    xa_unlock(&scull_devs);
+    return dev;
+}
+
+void scull_put_dev(struct scull_dev *dev) {
+    atomic_dec(&dev->users);
+}
+
+/* tear down a device no longer reachable and without users */
+static void scull_destroy_dev(struct scull_dev *dev) {
+    device_destroy(scull_class, MKDEV(MAJOR(scull_dev_num), dev->index));
+    cdev_del(dev->cdev);
+    /* no more readers of the counters */
+    scull_stats_del_dev(dev);
+    /* a reshape may outlive the file that started it */
+    scull_drain_storage();
+    if (*scull_backing) {
+        scull_backing_dump(dev, dev->index);
+    }
+    scull_trim(dev);
+    /* the storage can only go once the background trims are done */
+    scull_drain_storage();
+    scull_release_storage(dev);
+    kfree(dev);
+}
+
+/**
+ * Create a device on minor 'index', or on any free minor if negative,
+ * with its own quantum and qset size or the defaults for 0. Returns
+ * the minor.
+ */
+static int scull_add_dev(int index, int quantum, int qset) {
+    struct scull_dev *dev;
+    struct device *node;
+    u32 minor;
+    int ret;
+
+    if (quantum < 0 || qset < 0 || index >= scull_max_devs) {
+        return -EINVAL;
+    }
+    if ((quantum || qset) &&
+        !scull_valid_geometry(scull_default_engine, quantum ? quantum : scull_default_quantum(),
+                              qset ? qset : scull_qset)) {
+        return -EINVAL;
+    }
+    dev = kzalloc(sizeof(*dev), GFP_KERNEL);
+    if (!dev) {
+        return -ENOMEM;
+    }
+
+    mutex_lock(&scull_devs_lock);
+    /* reserve the minor, lookups see nothing there until it is stored */
+    if (index < 0) {
+        ret = xa_alloc(&scull_devs, &minor, NULL, XA_LIMIT(0, scull_max_devs - 1), GFP_KERNEL);
+        ret = ret == -EBUSY ? -ENOSPC : ret;
+    } else {
+        minor = index;
+        ret = xa_insert(&scull_devs, minor, NULL, GFP_KERNEL);
+        ret = ret == -EBUSY ? -EEXIST : ret;
+    }
+    if (ret) {
+        goto out_unlock;
+    }
+
+    dev->index   = minor;
+    dev->quantum = quantum;
+    dev->qset    = qset;
+    dev->size    = 0;
+    dev->reshape = 0;
+    atomic_set(&dev->users, 0);
+    atomic_set(&dev->vmas, 0);
+    init_rwsem(&dev->sem);
+    init_rwsem(&dev->wsem);
+    ret = scull_setup_storage(dev);
+    if (ret) {
+        pr_err("Error %d setting up storage of scull%u\n", ret, minor);
+        goto out_release;
+    }
+    /* a bad image is left alone, the device starts empty */
+    scull_backing_restore(dev, minor);
+
+    ret = -ENOMEM;
+    dev->cdev = cdev_alloc();
+    if (!dev->cdev) {
+        goto out_storage;
+    }
+    dev->cdev->ops   = &scull_fops;
+    dev->cdev->owner = THIS_MODULE;
+    xa_store(&scull_devs, minor, dev, GFP_KERNEL);
+    ret = cdev_add(dev->cdev, MKDEV(MAJOR(scull_dev_num), minor), 1);
+    if (ret) {
+        pr_err("Error %d adding scull%u\n", ret, minor);
+        /* nobody could open it yet */
+        xa_store(&scull_devs, minor, NULL, GFP_KERNEL);
+        kobject_put(&dev->cdev->kobj);
+        goto out_storage;
+    }
+    /* the node is a convenience, mknod works without it */
+    node = device_create(scull_class, NULL, MKDEV(MAJOR(scull_dev_num), minor), NULL,
+                         SCULL_MODULE_NAME "%u", minor);
+    if (IS_ERR(node)) {
+        pr_err("Error %ld creating the node of scull%u\n", PTR_ERR(node), minor);
+    }
+    scull_stats_add_dev(dev, minor);
+    mutex_unlock(&scull_devs_lock);
+    return minor;
+
+out_storage:
+    scull_trim(dev);
+    scull_drain_storage();
+    scull_release_storage(dev);
+out_release:
+    xa_release(&scull_devs, minor);
+out_unlock:
+    mutex_unlock(&scull_devs_lock);
+    kfree(dev);
+    return ret;
+}
+
+/* remove the device of minor 'index' unless it is in use */
+static int scull_remove_dev(int index) {
+    struct scull_dev *dev;
+    int ret = 0;
+
+    mutex_lock(&scull_devs_lock);
+    xa_lock(&scull_devs);
+    dev = xa_load(&scull_devs, index);
+    if (!dev) {
+        ret = -ENODEV;
+    } else if (atomic_read(&dev->users)) {
+        ret = -EBUSY;
+    } else {
+        /* from here on open() no longer finds it */
+        __xa_erase(&scull_devs, index);
+    }
+    xa_unlock(&scull_devs);
+    if (!ret) {
+        scull_destroy_dev(dev);
+    }
+    mutex_unlock(&scull_devs_lock);
+    return ret ? ret : index;
+}
+
+static void scull_remove_all(void) {
+    struct scull_dev *dev;
+    unsigned long index;
+
+    /* with the module going, nobody has a device open */
+    mutex_lock(&scull_devs_lock);
+    xa_for_each(&scull_devs, index, dev) {
+        xa_erase(&scull_devs, index);
+        scull_destroy_dev(dev);
+    }
+    mutex_unlock(&scull_devs_lock);
+}
+
+static long scull_control_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
+    struct scull_ctl ctl;
+
+    if (!capable(CAP_SYS_ADMIN)) {
+        return -EPERM;
+    }
+    switch (cmd) {
+        case SCULL_CTL_ADD:
+            if (copy_from_user(&ctl, (void __user *)arg, sizeof(ctl))) {
+                return -EFAULT;
+            }
+            return scull_add_dev(ctl.minor, ctl.quantum, ctl.qset);
+
+        case SCULL_CTL_REMOVE:
+            if (arg >= scull_max_devs) {
+                return -EINVAL;
+            }
+            return scull_remove_dev(arg);
+
+        default:
+            return -ENOTTY;
+    }
+}
+
+static const struct file_operations scull_control_fops = {
+    .owner          = THIS_MODULE,
+    .open           = nonseekable_open,
+    .unlocked_ioctl = scull_control_ioctl,
+    .compat_ioctl   = compat_ptr_ioctl,
+    .llseek         = noop_llseek,
+};
+
+/* like loop-control, creates and removes devices at runtime */
+static struct miscdevice scull_control = {
+    .minor = MISC_DYNAMIC_MINOR,
+    .name  = SCULL_MODULE_NAME "-control",
+    .fops  = &scull_control_fops,
 };
 
 
 static int __init scull_init(void) {
     int ret, i;
 
-    pr_info("Initialize scull module, scull_quantum: %d, scull_qset: %d, scull_nr_devs: %d\n", 
-            scull_quantum, scull_qset, scull_nr_devs);
+    pr_info("Initialize scull module, scull_quantum: %d, scull_qset: %d, scull_nr_devs: %d, scull_storage: %s\n", 
+            scull_quantum, scull_qset, scull_nr_devs, scull_storage);
+
+    if (scull_max_devs <= 0 || scull_max_devs > MINORMASK + 1 ||
+        scull_nr_devs < 0 || scull_nr_devs > scull_max_devs) {
+        pr_err("Invalid scull_nr_devs %d or scull_max_devs %d\n", scull_nr_devs, scull_max_devs);
+        ret = -EINVAL;
+        goto out;
+    }
 
-    /* request dynamicly-allocated device numbers */
+    /* request dynamicly-allocated device numbers, all a device may take */
     ret = alloc_chrdev_region(&scull_dev_num, 0,    /* Base number */
-                            scull_nr_devs,          /* Total device number */
+                            scull_max_devs,         /* Total device number */
                             SCULL_MODULE_NAME       /* Device module name */
                             );
     if (ret < 0) {
@@ -35,61 +296,68 @@ static int __init scull_init(void) {
         goto out;
     }
 
-    /* dynamically allocate memory for scull_devs array */
-    scull_devs = kzalloc(scull_nr_devs * sizeof(struct scull_dev), GFP_KERNEL);
-    if (!scull_devs) {
-        ret = -ENOMEM;
-        pr_err("Allocate device structure memory failed\n");
+    scull_class = class_create(THIS_MODULE, SCULL_MODULE_NAME);
+    if (IS_ERR(scull_class)) {
+        ret = PTR_ERR(scull_class);
+        pr_err("Create device class failed\n");
         goto unreg_chrdev;
     }
 
+    ret = scull_storage_init();
+    if (ret) {
+        pr_err("Create storage caches failed\n");
+        goto destroy_class;
+    }
+
     /* initialize the scull devices */
     pr_info("Initialize the scull devices\n");
+    scull_stats_init();
     for (i = 0; i < scull_nr_devs; i++) {
-        cdev_init(&scull_devs[i].cdev, &scull_fops);
-        scull_devs[i].cdev.owner = THIS_MODULE;
-        scull_devs[i].quantum    = scull_quantum;
-        scull_devs[i].qset       = scull_qset;
-        scull_devs[i].size       = 0;
-        scull_devs[i].data       = NULL;
-        mutex_init(&scull_devs[i].mlock);
-        ret = cdev_add(&scull_devs[i].cdev, 
-                        MKDEV(MAJOR(scull_dev_num), MINOR(scull_dev_num) + i), /* base responsible device number */
-                        1 /* the number of consecutive minor numbers corresponding to this device */);
-        if (ret) {
-            pr_err("Error %d adding scull%d\n", ret, i);
-            goto unreg_cdev;
+        ret = scull_add_dev(i, 0, 0);
+        if (ret < 0) {
+            goto remove_devs;
         }
     }
+
+    ret = misc_register(&scull_control);
+    if (ret) {
+        pr_err("Register %s failed\n", scull_control.name);
+        goto remove_devs;
+    }
+
+    ret = scull_block_init();
+    if (ret) {
+        pr_err("Create block devices failed\n");
+        goto dereg_control;
+    }
     pr_info("Module init was successful\n");
     return 0;
 
-unreg_cdev:
-    if (scull_devs) {
-        for (i = 0; i < scull_dev_num; i++) {
-            scull_trim(scull_devs + i);
-            cdev_del(&scull_devs[i].cdev);
-        }
-        kfree(scull_devs);
-    }
+dereg_control:
+    misc_deregister(&scull_control);
+remove_devs:
+    scull_remove_all();
+    scull_stats_exit();
+    scull_storage_exit();
+destroy_class:
+    class_destroy(scull_class);
 unreg_chrdev:
-    unregister_chrdev_region(scull_dev_num, scull_nr_devs);
+    unregister_chrdev_region(scull_dev_num, scull_max_devs);
 out:
     pr_info("Module insertion failed \n");
     return ret;
 }
 
 static void __exit scull_exit(void) {
-    int i;
-    if (scull_devs) {
-        for (i = 0; i < scull_nr_devs; i++) {
-            scull_trim(scull_devs + i);
-            cdev_del(&scull_devs[i].cdev);
-        }
-        kfree(scull_devs);
-    }
+    scull_block_exit();
+    /* no more devices coming */
+    misc_deregister(&scull_control);
+    scull_remove_all();
+    scull_stats_exit();
+    scull_storage_exit();
+    class_destroy(scull_class);
     /* cleanup_module is never called if registering failed */
-    unregister_chrdev_region(scull_dev_num, scull_nr_devs);
+    unregister_chrdev_region(scull_dev_num, scull_max_devs);
     pr_info("scull module clean up \n");
 }
 
@@ -99,4 +367,4 @@ module_exit(scull_exit);
 MODULE_AUTHOR("HangX-Ma");
 MODULE_LICENSE("Dual MIT/GPL");
 MODULE_DESCRIPTION("A module creates scull device");
-MODULE_INFO(modparams, "06-scull_basic");
\ No newline at end of file
+MODULE_INFO(modparams, "06-scull_basic");
@@ -0,0 +1,265 @@
+#include "scull.h"
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/sched/mm.h>
+
+int scull_blk_nr;
+int scull_blk_mb    = 64;
+int scull_blk_depth = 128;
+
+/**
+ * Block device front end, in the spirit of sbull: scullbN is a disk of
+ * scull_blk_mb MiB over a storage instance of its own, so a filesystem
+ * can sit on scull memory. There is a hardware queue per CPU and the
+ * requests are served in queue_rq() through the same read and write
+ * paths as the char devices, a whole request at a time: the device
+ * locks are taken once per request, shared, and each quantum set once
+ * per run of segments in it. Requests of different CPUs to different
+ * sets only wait for each other on a trim or a reshape, though they
+ * still share the cache lines of the device locks.
+ * The disk starts as one big hole, memory is taken as it is written,
+ * and discards punch the holes back, as do zeroing writes that don't
+ * ask to keep the space.
+ */
+struct scull_blk {
+    struct scull_dev dev;           /* the storage behind the disk */
+    struct blk_mq_tag_set tag_set;
+    struct gendisk *disk;
+};
+
+static int scull_blk_major;
+static struct scull_blk **scull_blks;
+
+/**
+ * Move the data of 'rq' from or to 'dev' with one iterator over all
+ * its segments, as the loop driver does: a single bio's vector is used
+ * in place, the segments of several bios are gathered into an array.
+ */
+static int scull_blk_transfer(struct scull_dev *dev, struct request *rq) {
+    bool write = op_is_write(req_op(rq));
+    unsigned int nr = blk_rq_nr_bvec(rq);
+    struct bio_vec *bvec, *gathered = NULL, tmp;
+    struct req_iterator rq_iter;
+    struct iov_iter iter;
+    struct kiocb kiocb = {
+        .ki_pos   = (loff_t)blk_rq_pos(rq) << SECTOR_SHIFT,
+        .ki_flags = (rq->cmd_flags & REQ_NOWAIT) ? IOCB_NOWAIT : 0,
+    };
+    size_t offset = 0;
+    ssize_t ret;
+
+    if (rq->bio != rq->biotail) {
+        gathered = kmalloc_array(nr, sizeof(*gathered), GFP_NOIO);
+        if (!gathered) {
+            return -ENOMEM;
+        }
+        bvec = gathered;
+        rq_for_each_bvec(tmp, rq, rq_iter) {
+            *bvec++ = tmp;
+        }
+        bvec = gathered;
+    } else {
+        offset = rq->bio->bi_iter.bi_bvec_done;
+        bvec   = __bvec_iter_bvec(rq->bio->bi_io_vec, rq->bio->bi_iter);
+    }
+    iov_iter_bvec(&iter, write ? WRITE : READ, bvec, nr, blk_rq_bytes(rq));
+    iter.iov_offset = offset;
+
+    ret = write ? scull_dev_write(dev, &kiocb, &iter) : scull_dev_read(dev, &kiocb, &iter);
+    kfree(gathered);
+    if (ret < 0) {
+        return ret;
+    }
+    /* the disk is as large as the device, a short transfer is an error */
+    return ret == blk_rq_bytes(rq) ? 0 : -EIO;
+}
+
+static blk_status_t scull_queue_rq(struct blk_mq_hw_ctx *hctx, const struct blk_mq_queue_data *bd) {
+    struct request *rq   = bd->rq;
+    struct scull_dev *dev = hctx->queue->queuedata;
+    loff_t pos = (loff_t)blk_rq_pos(rq) << SECTOR_SHIFT;
+    unsigned int noio;
+    int mode, ret = 0;
+
+    blk_mq_start_request(rq);
+    /*
+     * the paths below allocate with GFP_KERNEL, and reclaim must not
+     * wait on writeback through this very disk to satisfy them
+     */
+    noio = memalloc_noio_save();
+    switch (req_op(rq)) {
+        case REQ_OP_READ:
+        case REQ_OP_WRITE:
+            ret = scull_blk_transfer(dev, rq);
+            break;
+
+        case REQ_OP_DISCARD:
+        case REQ_OP_WRITE_ZEROES:
+            /* holes read back as zeros, unless the caller wants the space kept */
+            mode = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+            if (req_op(rq) == REQ_OP_WRITE_ZEROES && (rq->cmd_flags & REQ_NOUNMAP)) {
+                mode = FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE;
+            }
+            ret = scull_dev_fallocate(dev, mode, pos, blk_rq_bytes(rq));
+            break;
+
+        case REQ_OP_FLUSH:
+            /* nothing is cached on the way to memory */
+            break;
+
+        default:
+            ret = -EOPNOTSUPP;
+            break;
+    }
+    memalloc_noio_restore(noio);
+    blk_mq_end_request(rq, errno_to_blk_status(ret));
+    return BLK_STS_OK;
+}
+
+static const struct blk_mq_ops scull_mq_ops = {
+    .queue_rq = scull_queue_rq,
+};
+
+static const struct block_device_operations scull_blk_fops = {
+    .owner = THIS_MODULE,
+};
+
+static void scull_blk_free(struct scull_blk *blk) {
+    struct scull_dev *dev = &blk->dev;
+
+    scull_trim(dev);
+    /* the storage can only go once the background trims are done */
+    scull_drain_storage();
+    scull_release_storage(dev);
+    kfree(blk);
+}
+
+static struct scull_blk *scull_blk_create(int index) {
+    sector_t sectors = (sector_t)scull_blk_mb << (20 - SECTOR_SHIFT);
+    struct request_queue *queue;
+    struct scull_blk *blk;
+    struct scull_dev *dev;
+    int ret;
+
+    blk = kzalloc(sizeof(*blk), GFP_KERNEL);
+    if (!blk) {
+        return ERR_PTR(-ENOMEM);
+    }
+    dev = &blk->dev;
+    dev->index = index;
+    atomic_set(&dev->vmas, 0);
+    init_rwsem(&dev->sem);
+    init_rwsem(&dev->wsem);
+    ret = scull_setup_storage(dev);
+    if (ret) {
+        kfree(blk);
+        return ERR_PTR(ret);
+    }
+    /* all of it is there from the start, as holes */
+    dev->size = (unsigned long)sectors << SECTOR_SHIFT;
+
+    /* queue_rq() sleeps on the scull semaphores and in the allocator */
+    blk->tag_set.ops          = &scull_mq_ops;
+    blk->tag_set.nr_hw_queues = nr_cpu_ids;
+    blk->tag_set.queue_depth  = scull_blk_depth;
+    blk->tag_set.numa_node    = NUMA_NO_NODE;
+    blk->tag_set.flags        = BLK_MQ_F_SHOULD_MERGE | BLK_MQ_F_BLOCKING;
+    ret = blk_mq_alloc_tag_set(&blk->tag_set);
+    if (ret) {
+        goto fail_storage;
+    }
+    queue = blk_mq_init_queue(&blk->tag_set);
+    if (IS_ERR(queue)) {
+        ret = PTR_ERR(queue);
+        goto fail_tag_set;
+    }
+    queue->queuedata = dev;
+    blk_queue_physical_block_size(queue, PAGE_SIZE);
+    blk_queue_flag_set(QUEUE_FLAG_NONROT, queue);
+    blk_queue_flag_set(QUEUE_FLAG_DISCARD, queue);
+    queue->limits.discard_granularity = PAGE_SIZE;
+    blk_queue_max_discard_sectors(queue, UINT_MAX >> SECTOR_SHIFT);
+    blk_queue_max_write_zeroes_sectors(queue, UINT_MAX >> SECTOR_SHIFT);
+
+    blk->disk = alloc_disk(1);
+    if (!blk->disk) {
+        ret = -ENOMEM;
+        goto fail_queue;
+    }
+    blk->disk->major        = scull_blk_major;
+    blk->disk->first_minor  = index;
+    blk->disk->fops         = &scull_blk_fops;
+    blk->disk->queue        = queue;
+    blk->disk->private_data = blk;
+    snprintf(blk->disk->disk_name, DISK_NAME_LEN, SCULL_MODULE_NAME "b%d", index);
+    set_capacity(blk->disk, sectors);
+    add_disk(blk->disk);
+    return blk;
+
+fail_queue:
+    blk_cleanup_queue(queue);
+fail_tag_set:
+    blk_mq_free_tag_set(&blk->tag_set);
+fail_storage:
+    scull_blk_free(blk);
+    return ERR_PTR(ret);
+}
+
+static void scull_blk_destroy(struct scull_blk *blk) {
+    struct request_queue *queue = blk->disk->queue;
+
+    del_gendisk(blk->disk);
+    blk_cleanup_queue(queue);
+    put_disk(blk->disk);
+    blk_mq_free_tag_set(&blk->tag_set);
+    scull_blk_free(blk);
+}
+
+int scull_block_init(void) {
+    struct scull_blk *blk;
+    int i;
+
+    if (!scull_blk_nr) {
+        return 0;
+    }
+    if (scull_blk_nr < 0 || scull_blk_mb <= 0 || scull_blk_depth <= 0 ||
+        scull_blk_mb > (LONG_MAX >> 20)) {
+        pr_err("Invalid scull_blk_nr %d, scull_blk_mb %d or scull_blk_depth %d\n",
+               scull_blk_nr, scull_blk_mb, scull_blk_depth);
+        return -EINVAL;
+    }
+    scull_blk_major = register_blkdev(0, SCULL_MODULE_NAME);
+    if (scull_blk_major < 0) {
+        return scull_blk_major;
+    }
+    scull_blks = kcalloc(scull_blk_nr, sizeof(*scull_blks), GFP_KERNEL);
+    if (!scull_blks) {
+        unregister_blkdev(scull_blk_major, SCULL_MODULE_NAME);
+        return -ENOMEM;
+    }
+    for (i = 0; i < scull_blk_nr; i++) {
+        blk = scull_blk_create(i);
+        if (IS_ERR(blk)) {
+            pr_err("Error %ld adding " SCULL_MODULE_NAME "b%d\n", PTR_ERR(blk), i);
+            /* the disks before it are torn down again */
+            scull_block_exit();
+            return PTR_ERR(blk);
+        }
+        scull_blks[i] = blk;
+    }
+    return 0;
+}
+
+void scull_block_exit(void) {
+    int i;
+
+    if (!scull_blks) {
+        return;
+    }
+    for (i = 0; i < scull_blk_nr && scull_blks[i]; i++) {
+        scull_blk_destroy(scull_blks[i]);
+    }
+    kfree(scull_blks);
+    scull_blks = NULL;
+    unregister_blkdev(scull_blk_major, SCULL_MODULE_NAME);
+}
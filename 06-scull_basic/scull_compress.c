@@ -0,0 +1,220 @@
+#include "scull.h"
+#include <linux/crypto.h>
+
+char *scull_compress = "lz4";
+int scull_compress_ms;
+
+/**
+ * Compression of cold quanta. With scull_compress_ms set, each device
+ * runs a delayed work that compresses the quanta of sets untouched for
+ * that long. A compressed quantum is a kmalloc'ed blob whose pointer
+ * is tagged with SCULL_ZQUANTUM; writers get it back in plain form
+ * through scull_unshare_quantum(), readers decompress it into a
+ * temporary buffer and leave it compressed. Sets shared with a
+ * snapshot and mapped devices are left alone. The shrinker compresses
+ * quanta the same way for devices with the compress policy.
+ *
+ * As in zram, every CPU has its own transform, the compressors keep
+ * per-transform scratch state.
+ */
+struct scull_zquantum {
+    unsigned int len;
+    u8 buf[];
+};
+
+static struct crypto_comp * __percpu *scull_tfms;
+
+static struct scull_zquantum *scull_zquantum(const void *quantum) {
+    return (struct scull_zquantum *)((unsigned long)quantum & ~SCULL_ZQUANTUM);
+}
+
+size_t scull_zquantum_size(const void *quantum) {
+    struct scull_zquantum *zq = scull_zquantum(quantum);
+
+    return struct_size(zq, buf, zq->len);
+}
+
+void scull_free_zquantum(void *quantum) {
+    kfree(scull_zquantum(quantum));
+}
+
+bool scull_can_compress(void) {
+    return scull_tfms != NULL;
+}
+
+/* decompress 'quantum' into 'plain', of a quantum size */
+int scull_decompress_quantum(struct scull_layout *layout, const void *quantum, void *plain) {
+    struct scull_zquantum *zq = scull_zquantum(quantum);
+    unsigned int len = layout->quantum;
+    struct crypto_comp *tfm;
+    u64 start;
+    int ret;
+
+    start = ktime_get_ns();
+    tfm = *get_cpu_ptr(scull_tfms);
+    ret = crypto_comp_decompress(tfm, zq->buf, zq->len, plain, &len);
+    put_cpu_ptr(scull_tfms);
+    scull_stat_add(layout->stats, SCULL_STAT_DECOMPRESS_NS, ktime_get_ns() - start);
+    scull_stat_inc(layout->stats, SCULL_STAT_DECOMPRESSIONS);
+    scull_hist_end(layout->stats, SCULL_PHASE_DECOMPRESS, start);
+
+    if (WARN_ONCE(ret || len != layout->quantum, "corrupted quantum, ret %d len %u\n", ret, len)) {
+        return -EIO;
+    }
+    return 0;
+}
+
+/**
+ * Decompress 'quantum' into a temporary buffer for a reader, to be
+ * freed with kvfree(). It is not a quantum of the device: it neither
+ * counts in its usage nor is refused past the caps.
+ */
+void *scull_inflate_quantum(struct scull_layout *layout, const void *quantum, gfp_t gfp) {
+    void *plain = kvmalloc(layout->quantum, gfp);
+
+    if (plain && scull_decompress_quantum(layout, quantum, plain)) {
+        kvfree(plain);
+        return NULL;
+    }
+    return plain;
+}
+
+/**
+ * Replace quantum 'i' of 'dptr' by a compressed copy if that saves a
+ * quarter, using 'buf' of a quantum size as scratch space. Returns the
+ * bytes saved.
+ */
+size_t scull_deflate_quantum(struct scull_layout *layout, struct scull_qset *dptr,
+                             int i, void *buf, gfp_t gfp) {
+    unsigned int len = layout->quantum;
+    struct scull_zquantum *zq;
+    struct crypto_comp *tfm;
+    int ret;
+
+    tfm = *get_cpu_ptr(scull_tfms);
+    ret = crypto_comp_compress(tfm, dptr->data[i], layout->quantum, buf, &len);
+    put_cpu_ptr(scull_tfms);
+    if (ret || struct_size(zq, buf, len) > layout->quantum - layout->quantum / 4) {
+        return 0;
+    }
+
+    zq = kmalloc(struct_size(zq, buf, len), gfp | __GFP_NOWARN);
+    if (!zq) {
+        return 0;
+    }
+    zq->len = len;
+    memcpy(zq->buf, buf, len);
+    scull_account(layout, struct_size(zq, buf, len));
+
+    scull_stat_add(layout->stats, SCULL_STAT_ZBYTES_IN, layout->quantum);
+    scull_stat_add(layout->stats, SCULL_STAT_ZBYTES_OUT, len);
+    scull_free_quantum(layout, dptr->data[i]);
+    dptr->data[i] = (void *)((unsigned long)zq | SCULL_ZQUANTUM);
+    return layout->quantum - struct_size(zq, buf, len);
+}
+
+static void scull_compress_work(struct work_struct *work) {
+    struct scull_dev *dev = container_of(to_delayed_work(work), struct scull_dev, compress_work);
+    unsigned long interval = msecs_to_jiffies(scull_compress_ms);
+    struct scull_layout *layout;
+    struct scull_qset *dptr;
+    unsigned long item;
+    void *buf;
+    int i;
+
+    down_read(&dev->sem);
+    layout = dev->layout;
+    buf = kmalloc(layout->quantum, GFP_KERNEL);
+    if (!buf || atomic_read(&dev->vmas)) {
+        goto out;
+    }
+
+    xa_for_each(dev->qsets, item, dptr) {
+        if (time_before(jiffies, READ_ONCE(dptr->atime) + interval)) {
+            continue;
+        }
+        /* busy sets aren't cold anyway */
+        if (!down_write_trylock(&dptr->sem)) {
+            continue;
+        }
+        if (dptr->data && refcount_read(&dptr->refs) == 1) {
+            for (i = 0; i < layout->qset; i++) {
+                /* the other owners keep pointing at the plain copy */
+                if (dptr->data[i] && !scull_quantum_compressed(dptr->data[i]) &&
+                    !scull_quantum_shared(layout, dptr->data[i])) {
+                    scull_deflate_quantum(layout, dptr, i, buf, GFP_KERNEL);
+                }
+            }
+        }
+        up_write(&dptr->sem);
+        cond_resched();
+    }
+
+out:
+    up_read(&dev->sem);
+    kfree(buf);
+    queue_delayed_work(system_unbound_wq, &dev->compress_work, interval);
+}
+
+void scull_compress_start(struct scull_dev *dev) {
+    INIT_DELAYED_WORK(&dev->compress_work, scull_compress_work);
+    if (scull_tfms && scull_compress_ms > 0) {
+        queue_delayed_work(system_unbound_wq, &dev->compress_work,
+                           msecs_to_jiffies(scull_compress_ms));
+    }
+}
+
+void scull_compress_stop(struct scull_dev *dev) {
+    if (scull_tfms && scull_compress_ms > 0) {
+        cancel_delayed_work_sync(&dev->compress_work);
+    }
+}
+
+/*
+ * The transforms are set up whenever the algorithm is there, so the
+ * compress shrink policy can be picked at run time; only an explicit
+ * request for compression makes a missing one fatal.
+ */
+int scull_compress_init(void) {
+    struct crypto_comp *tfm;
+    int cpu;
+
+    if (!crypto_has_comp(scull_compress, 0, 0)) {
+        if (scull_compress_ms <= 0 && scull_default_shrink != SCULL_SHRINK_COMPRESS) {
+            return 0;
+        }
+        pr_err("Unknown compression algorithm '%s'\n", scull_compress);
+        return -EINVAL;
+    }
+
+    scull_tfms = alloc_percpu(struct crypto_comp *);
+    if (!scull_tfms) {
+        return -ENOMEM;
+    }
+    for_each_possible_cpu(cpu) {
+        tfm = crypto_alloc_comp(scull_compress, 0, 0);
+        if (IS_ERR(tfm)) {
+            scull_compress_exit();
+            return PTR_ERR(tfm);
+        }
+        *per_cpu_ptr(scull_tfms, cpu) = tfm;
+    }
+    return 0;
+}
+
+void scull_compress_exit(void) {
+    struct crypto_comp *tfm;
+    int cpu;
+
+    if (!scull_tfms) {
+        return;
+    }
+    for_each_possible_cpu(cpu) {
+        tfm = *per_cpu_ptr(scull_tfms, cpu);
+        if (tfm) {
+            crypto_free_comp(tfm);
+        }
+    }
+    free_percpu(scull_tfms);
+    scull_tfms = NULL;
+}
@@ -0,0 +1,199 @@
+#include "scull.h"
+#include <linux/xxhash.h>
+
+char *scull_dedup = "off";
+int scull_dedup_ms = 1000;
+int scull_dedup_mode;
+
+/**
+ * Deduplication, off by default like compression: both spend CPU time
+ * to save memory. With scull_dedup=zero, a quantum a writer leaves all
+ * zeros is freed on the spot: the hole in its place reads back the
+ * same and costs nothing.
+ *
+ * With scull_dedup=hash, zero quanta go too, and a delayed work per
+ * device hashes the quanta of a batch of sets every scull_dedup_ms,
+ * and merges a quantum with an identical one seen before: the quantum
+ * gets a second owner, so the first write to either copies it as for
+ * snapshots, and the sharing ends with the last other owner. The hash
+ * only picks candidates, the contents are compared before merging.
+ * Mapped devices, sets held by a snapshot, sets being written and
+ * compressed quanta are skipped.
+ */
+#define SCULL_DEDUP_SETS 64    /* quantum sets hashed per pass */
+
+/**
+ * The positions seen are kept in a table of fixed size, indexed by the
+ * low bits of the hash: a later quantum takes the slot of an earlier
+ * one with the same bits, so some duplicates are missed on a large
+ * device but the table never grows. It is charged to the memory
+ * cgroup of the first pass.
+ */
+#define SCULL_DEDUP_BITS 12
+
+struct scull_dedup_slot {
+    u64 hash;
+    unsigned long pos;          /* position seen plus one, 0 if free */
+};
+
+static const char * const scull_dedup_names[] = {
+    [SCULL_DEDUP_OFF]  = "off",
+    [SCULL_DEDUP_ZERO] = "zero",
+    [SCULL_DEDUP_HASH] = "hash",
+};
+
+/**
+ * Called by writers after storing 'len' bytes at 'offset' of quantum
+ * 'i' of 'dptr'. 'fresh' says the quantum was allocated for them, so
+ * the rest of it is zeros; otherwise only a write covering it all is
+ * checked. A mapped page must stay where it is.
+ */
+void scull_dedup_zero(struct scull_dev *dev, struct scull_qset *dptr, int i,
+                      int offset, size_t len, bool fresh) {
+    if (scull_dedup_mode == SCULL_DEDUP_OFF || atomic_read(&dev->vmas)) {
+        return;
+    }
+    if (!fresh && len != dev->layout->quantum) {
+        return;
+    }
+    if (len && memchr_inv(dptr->data[i] + offset, 0, len)) {
+        return;
+    }
+    scull_put_quantum(dev->layout, dptr, i);
+    scull_stat_inc(dev->stats, SCULL_STAT_DEDUP_ZERO);
+}
+
+/* a plain quantum 'i' of a set only the device holds */
+static void *scull_dedup_candidate(struct scull_qset *dptr, int i) {
+    if (!dptr || !dptr->data || refcount_read(&dptr->refs) != 1) {
+        return NULL;
+    }
+    if (!dptr->data[i] || scull_quantum_compressed(dptr->data[i])) {
+        return NULL;
+    }
+    return dptr->data[i];
+}
+
+/**
+ * Merge quantum 'i' of 'dptr', locked for writing, into the identical
+ * one at position 'seen' if it is still there. The other set is only
+ * trylocked, two sets are never waited for at once.
+ */
+static void scull_dedup_merge(struct scull_dev *dev, unsigned long item, struct scull_qset *dptr,
+                              int i, unsigned long seen) {
+    struct scull_layout *layout = dev->layout;
+    unsigned long oitem = seen / layout->qset;
+    int oi = seen % layout->qset;
+    struct scull_qset *other = oitem == item ? dptr : xa_load(dev->qsets, oitem);
+    void *quantum;
+
+    if (other != dptr && (!other || !down_write_trylock(&other->sem))) {
+        return;
+    }
+    quantum = scull_dedup_candidate(other, oi);
+    if (quantum && quantum != dptr->data[i] &&
+        !memcmp(quantum, dptr->data[i], layout->quantum) &&
+        !scull_share_quantum(layout, quantum, GFP_KERNEL)) {
+        scull_put_quantum(layout, dptr, i);
+        dptr->data[i] = quantum;
+        scull_stat_inc(dev->stats, SCULL_STAT_DEDUP_MERGED);
+    }
+    if (other != dptr) {
+        up_write(&other->sem);
+    }
+}
+
+static void scull_dedup_work(struct work_struct *work) {
+    struct scull_dev *dev = container_of(to_delayed_work(work), struct scull_dev, dedup_work);
+    struct scull_layout *layout;
+    struct scull_dedup_slot *slot;
+    struct scull_qset *dptr;
+    unsigned long item, pos;
+    u64 hash;
+    int i, nr = 0;
+
+    down_read(&dev->sem);
+    layout = dev->layout;
+    if (atomic_read(&dev->vmas)) {
+        goto out;
+    }
+
+    /*
+     * Positions seen are kept from pass to pass, stale ones simply
+     * fail the comparison; a new sweep of the device starts afresh.
+     */
+    if (!dev->dedup_seen) {
+        dev->dedup_seen = kvcalloc(1 << SCULL_DEDUP_BITS, sizeof(*dev->dedup_seen),
+                                   GFP_KERNEL_ACCOUNT);
+        if (!dev->dedup_seen) {
+            goto out;
+        }
+        dev->dedup_next = 0;
+    }
+    item = dev->dedup_next;
+    if (!item) {
+        memset(dev->dedup_seen, 0, sizeof(*dev->dedup_seen) << SCULL_DEDUP_BITS);
+    }
+    for (dptr = xa_find(dev->qsets, &item, ULONG_MAX, XA_PRESENT); dptr && nr < SCULL_DEDUP_SETS;
+         dptr = xa_find_after(dev->qsets, &item, ULONG_MAX, XA_PRESENT), nr++) {
+        if (!down_write_trylock(&dptr->sem)) {
+            continue;
+        }
+        for (i = 0; i < layout->qset; i++) {
+            if (!scull_dedup_candidate(dptr, i)) {
+                continue;
+            }
+            hash = xxh64(dptr->data[i], layout->quantum, 0);
+            pos  = item * layout->qset + i;
+            slot = &dev->dedup_seen[hash & ((1 << SCULL_DEDUP_BITS) - 1)];
+            if (slot->pos && slot->hash == hash) {
+                if (slot->pos - 1 != pos) {
+                    scull_dedup_merge(dev, item, dptr, i, slot->pos - 1);
+                }
+            } else {
+                slot->hash = hash;
+                slot->pos  = pos + 1;
+            }
+        }
+        up_write(&dptr->sem);
+        cond_resched();
+    }
+    /* stopped short of the end: resume there */
+    dev->dedup_next = dptr ? item : 0;
+
+out:
+    up_read(&dev->sem);
+    queue_delayed_work(system_unbound_wq, &dev->dedup_work, msecs_to_jiffies(scull_dedup_ms));
+}
+
+void scull_dedup_start(struct scull_dev *dev) {
+    dev->dedup_seen = NULL;
+    dev->dedup_next = 0;
+    INIT_DELAYED_WORK(&dev->dedup_work, scull_dedup_work);
+    if (scull_dedup_mode == SCULL_DEDUP_HASH) {
+        queue_delayed_work(system_unbound_wq, &dev->dedup_work, msecs_to_jiffies(scull_dedup_ms));
+    }
+}
+
+void scull_dedup_stop(struct scull_dev *dev) {
+    if (scull_dedup_mode == SCULL_DEDUP_HASH) {
+        cancel_delayed_work_sync(&dev->dedup_work);
+    }
+    kvfree(dev->dedup_seen);
+    dev->dedup_seen = NULL;
+}
+
+int scull_dedup_init(void) {
+    int ret = match_string(scull_dedup_names, ARRAY_SIZE(scull_dedup_names), scull_dedup);
+
+    if (ret < 0) {
+        pr_err("Unknown dedup mode '%s'\n", scull_dedup);
+        return -EINVAL;
+    }
+    if (ret == SCULL_DEDUP_HASH && scull_dedup_ms <= 0) {
+        pr_err("Invalid scull_dedup_ms %d\n", scull_dedup_ms);
+        return -EINVAL;
+    }
+    scull_dedup_mode = ret;
+    return 0;
+}
@@ -0,0 +1,220 @@
+#include "scull.h"
+
+/**
+ * The ioctl() implementation, as in the book: the quantum and qset
+ * commands act on the module-wide defaults, which each device picks up
+ * at its next trim. Changing the geometry of a device that holds data
+ * is what SCULL_IOCRESHAPE is for.
+ */
+
+static DEFINE_MUTEX(scull_defaults_lock);
+
+/**
+ * Validate and install 'val' as the default quantum ('quantum' set) or
+ * qset, the previous value goes to 'old' if not NULL. The pair is
+ * checked and updated under a mutex, so two callers changing one each
+ * can't leave an invalid pair behind.
+ */
+static int scull_set_default(bool quantum, unsigned long val, int *old) {
+    int *def = quantum ? &scull_quantum : &scull_qset;
+    bool valid;
+
+    /* Tell and sHift pass the value itself, any unsigned long */
+    if (val > INT_MAX) {
+        return -EINVAL;
+    }
+    mutex_lock(&scull_defaults_lock);
+    if (old) {
+        *old = *def;
+    }
+    valid = quantum ? scull_valid_defaults(val, scull_qset) : scull_valid_defaults(scull_quantum, val);
+    if (valid) {
+        WRITE_ONCE(*def, val);
+    }
+    mutex_unlock(&scull_defaults_lock);
+    return valid ? 0 : -EINVAL;
+}
+
+long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
+    struct scull_dev *dev = filp->private_data;
+    struct scull_geometry geo;
+    struct scull_numa numa;
+    struct scull_fallocate falloc;
+    int retval = 0, tmp, val;
+
+    /*
+     * extract the type and number bitfields, and don't decode
+     * wrong cmds: return ENOTTY (inappropriate ioctl) before access_ok()
+     */
+    if (_IOC_TYPE(cmd) != SCULL_IOC_MAGIC) {
+        return -ENOTTY;
+    }
+    if (_IOC_NR(cmd) > SCULL_IOC_MAXNR) {
+        return -ENOTTY;
+    }
+
+    switch (cmd) {
+        case SCULL_IOCRESET:
+            mutex_lock(&scull_defaults_lock);
+            WRITE_ONCE(scull_quantum, SCULL_QUANTUM);
+            WRITE_ONCE(scull_qset, SCULL_QSET);
+            mutex_unlock(&scull_defaults_lock);
+            break;
+
+        case SCULL_IOCSQUANTUM: /* Set: arg points to the value */
+        case SCULL_IOCSQSET:
+            if (!capable(CAP_SYS_ADMIN)) {
+                return -EPERM;
+            }
+            if (get_user(val, (int __user *)arg)) {
+                return -EFAULT;
+            }
+            /* a negative value is past INT_MAX as an unsigned long */
+            retval = scull_set_default(cmd == SCULL_IOCSQUANTUM, val, NULL);
+            break;
+
+        case SCULL_IOCTQUANTUM: /* Tell: arg is the value */
+            if (!capable(CAP_SYS_ADMIN)) {
+                return -EPERM;
+            }
+            retval = scull_set_default(true, arg, NULL);
+            break;
+
+        case SCULL_IOCTQSET:
+            if (!capable(CAP_SYS_ADMIN)) {
+                return -EPERM;
+            }
+            retval = scull_set_default(false, arg, NULL);
+            break;
+
+        case SCULL_IOCGQUANTUM: /* Get: arg is pointer to result */
+            retval = put_user(scull_quantum, (int __user *)arg);
+            break;
+
+        case SCULL_IOCGQSET:
+            retval = put_user(scull_qset, (int __user *)arg);
+            break;
+
+        case SCULL_IOCQQUANTUM: /* Query: return it (it's positive) */
+            return scull_quantum;
+
+        case SCULL_IOCQQSET:
+            return scull_qset;
+
+        case SCULL_IOCXQUANTUM: /* eXchange: use arg as pointer */
+        case SCULL_IOCXQSET:
+            if (!capable(CAP_SYS_ADMIN)) {
+                return -EPERM;
+            }
+            if (get_user(val, (int __user *)arg)) {
+                return -EFAULT;
+            }
+            retval = scull_set_default(cmd == SCULL_IOCXQUANTUM, val, &tmp);
+            if (retval == 0) {
+                retval = put_user(tmp, (int __user *)arg);
+            }
+            break;
+
+        case SCULL_IOCHQUANTUM: /* sHift: like Tell + Query */
+            if (!capable(CAP_SYS_ADMIN)) {
+                return -EPERM;
+            }
+            retval = scull_set_default(true, arg, &tmp);
+            return retval ? retval : tmp;
+
+        case SCULL_IOCHQSET:
+            if (!capable(CAP_SYS_ADMIN)) {
+                return -EPERM;
+            }
+            retval = scull_set_default(false, arg, &tmp);
+            return retval ? retval : tmp;
+
+        /* the pipe buffer size belongs to 09-scull_pipe */
+        case SCULL_P_IOCTSIZE:
+        case SCULL_P_IOCQSIZE:
+            return -ENOTTY;
+
+        case SCULL_IOCRESHAPE:
+            if (!capable(CAP_SYS_ADMIN)) {
+                return -EPERM;
+            }
+            if (copy_from_user(&geo, (void __user *)arg, sizeof(geo))) {
+                return -EFAULT;
+            }
+            retval = scull_reshape(dev, geo.quantum, geo.qset);
+            break;
+
+        case SCULL_IOCQRESHAPE:
+            return READ_ONCE(dev->reshape);
+
+        case SCULL_IOCSNAPSHOT:
+            /* no reading through a snapshot of a write-only open */
+            if (!(filp->f_mode & FMODE_READ)) {
+                return -EBADF;
+            }
+            return scull_snapshot(dev);
+
+        case SCULL_IOCTLIMIT:
+            if (!capable(CAP_SYS_ADMIN)) {
+                return -EPERM;
+            }
+            /* the query has to return it */
+            if (arg > LONG_MAX) {
+                return -EINVAL;
+            }
+            WRITE_ONCE(dev->limit, arg);
+            break;
+
+        case SCULL_IOCQLIMIT:
+            return READ_ONCE(dev->limit);
+
+        case SCULL_IOCTSHRINK:
+            if (!capable(CAP_SYS_ADMIN)) {
+                return -EPERM;
+            }
+            retval = scull_set_shrink(dev, arg);
+            break;
+
+        case SCULL_IOCQSHRINK:
+            return READ_ONCE(dev->shrink);
+
+        case SCULL_IOCSNUMA:
+            if (!capable(CAP_SYS_ADMIN)) {
+                return -EPERM;
+            }
+            if (copy_from_user(&numa, (void __user *)arg, sizeof(numa))) {
+                return -EFAULT;
+            }
+            retval = scull_set_placement(dev, numa.policy, numa.node);
+            break;
+
+        case SCULL_IOCGNUMA:
+            numa.policy = READ_ONCE(dev->placement.policy);
+            numa.node   = READ_ONCE(dev->placement.node);
+            if (copy_to_user((void __user *)arg, &numa, sizeof(numa))) {
+                return -EFAULT;
+            }
+            break;
+
+        case SCULL_IOCDUMP:
+            if (!capable(CAP_SYS_ADMIN)) {
+                return -EPERM;
+            }
+            return scull_backing_dump(dev, iminor(file_inode(filp)));
+
+        case SCULL_IOCFALLOCATE:
+            /* as fallocate(2) */
+            if (!(filp->f_mode & FMODE_WRITE)) {
+                return -EBADF;
+            }
+            if (copy_from_user(&falloc, (void __user *)arg, sizeof(falloc))) {
+                return -EFAULT;
+            }
+            return scull_dev_fallocate(dev, falloc.mode, falloc.offset, falloc.len);
+
+        default: /* redundant, as cmd was checked against MAXNR */
+            return -ENOTTY;
+    }
+
+    return retval;
+}
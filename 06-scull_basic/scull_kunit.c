@@ -0,0 +1,167 @@
+#include "scull.h"
+#include <kunit/test.h>
+
+/**
+ * KUnit tests of the storage core, on a scratch device with the
+ * default geometry: the quantum set lookup, where bytes land around
+ * quantum and set boundaries, reading them back, and trimming. The
+ * timed case runs the passes of scull_microbench.c and only reports
+ * them. See .kunitconfig.
+ */
+static long scull_test_io(struct scull_dev *dev, loff_t pos, void *buf, size_t len, bool write) {
+    struct kvec kv = { .iov_base = buf, .iov_len = len };
+    struct kiocb kiocb = { .ki_pos = pos };
+    struct iov_iter iter;
+
+    iov_iter_kvec(&iter, write ? WRITE : READ, &kv, 1, len);
+    return write ? scull_dev_write(dev, &kiocb, &iter) : scull_dev_read(dev, &kiocb, &iter);
+}
+
+/* the byte stored at 'pos', worked out apart from the I/O paths */
+static u8 *scull_test_byte(struct scull_dev *dev, unsigned long pos) {
+    int quantum = dev->layout->quantum, qset = dev->layout->qset;
+    unsigned long itemsize = (unsigned long)quantum * qset;
+    struct scull_qset *dptr = xa_load(dev->qsets, pos / itemsize);
+    int s_pos = (pos % itemsize) / quantum;
+
+    if (!dptr || !dptr->data || !dptr->data[s_pos]) {
+        return NULL;
+    }
+    return (u8 *)dptr->data[s_pos] + pos % quantum;
+}
+
+static void scull_test_follow(struct kunit *test) {
+    struct scull_dev *dev = test->priv;
+    struct scull_qset *first, *second;
+
+    down_write(&dev->sem);
+    first = scull_follow(dev, 0, GFP_KERNEL);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, first);
+    KUNIT_EXPECT_PTR_EQ(test, scull_follow(dev, 0, GFP_KERNEL), first);
+    KUNIT_EXPECT_PTR_EQ(test, first->data, NULL);
+
+    second = scull_follow(dev, 1, GFP_KERNEL);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, second);
+    KUNIT_EXPECT_PTR_NE(test, second, first);
+    KUNIT_EXPECT_PTR_EQ(test, xa_load(dev->qsets, 1), second);
+
+    /* sets are created alone, not with the ones before them */
+    KUNIT_EXPECT_NOT_ERR_OR_NULL(test, scull_follow(dev, 1000, GFP_KERNEL));
+    KUNIT_EXPECT_PTR_EQ(test, xa_load(dev->qsets, 999), NULL);
+    up_write(&dev->sem);
+}
+
+static void scull_test_offsets(struct kunit *test) {
+    struct scull_dev *dev = test->priv;
+    unsigned long quantum = dev->layout->quantum;
+    unsigned long itemsize = quantum * dev->layout->qset;
+    unsigned long pos[] = {
+        0, quantum - 1, quantum, itemsize - 1, itemsize, itemsize + quantum,
+        3 * itemsize + 2 * quantum + 7,
+    };
+    u8 byte, *stored;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(pos); i++) {
+        byte = i + 1;
+        KUNIT_ASSERT_EQ(test, scull_test_io(dev, pos[i], &byte, 1, true), 1L);
+    }
+    for (i = 0; i < ARRAY_SIZE(pos); i++) {
+        stored = scull_test_byte(dev, pos[i]);
+        KUNIT_ASSERT_NOT_ERR_OR_NULL(test, stored);
+        KUNIT_EXPECT_EQ(test, (int)*stored, i + 1);
+    }
+    KUNIT_EXPECT_EQ(test, dev->size, pos[ARRAY_SIZE(pos) - 1] + 1);
+}
+
+static void scull_test_boundaries(struct kunit *test) {
+    struct scull_dev *dev = test->priv;
+    long quantum = dev->layout->quantum;
+    long itemsize = quantum * dev->layout->qset;
+    long len = 2 * quantum + 2;
+    long start = itemsize - quantum - 1;
+    u8 *in, *out;
+    long i;
+
+    in  = kunit_kzalloc(test, len, GFP_KERNEL);
+    out = kunit_kzalloc(test, len, GFP_KERNEL);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, in);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, out);
+    for (i = 0; i < len; i++) {
+        in[i] = i % 251 + 1;
+    }
+
+    /* from the end of a quantum, over the last one of the set, into the next set */
+    KUNIT_ASSERT_EQ(test, scull_test_io(dev, start, in, len, true), len);
+    KUNIT_EXPECT_EQ(test, dev->size, (unsigned long)(start + len));
+    KUNIT_ASSERT_EQ(test, scull_test_io(dev, start, out, len, false), len);
+    KUNIT_EXPECT_EQ(test, memcmp(in, out, len), 0);
+
+    /* the hole before it reads back as zeros, the end stops a read */
+    KUNIT_ASSERT_EQ(test, scull_test_io(dev, 0, out, quantum, false), quantum);
+    KUNIT_EXPECT_FALSE(test, memchr_inv(out, 0, quantum));
+    KUNIT_EXPECT_EQ(test, scull_test_io(dev, start + 1, out, len, false), len - 1);
+    KUNIT_EXPECT_EQ(test, scull_test_io(dev, start + len, out, len, false), 0L);
+}
+
+static void scull_test_trim(struct kunit *test) {
+    struct scull_dev *dev = test->priv;
+    unsigned long pos = 2UL * dev->layout->quantum * dev->layout->qset;
+    u8 byte = 0xa5;
+
+    KUNIT_ASSERT_EQ(test, scull_test_io(dev, pos, &byte, 1, true), 1L);
+
+    down_write(&dev->sem);
+    atomic_inc(&dev->vmas);
+    KUNIT_EXPECT_EQ(test, scull_trim(dev), -EBUSY);
+    KUNIT_EXPECT_EQ(test, dev->size, pos + 1);
+    atomic_dec(&dev->vmas);
+
+    KUNIT_EXPECT_EQ(test, scull_trim(dev), 0);
+    KUNIT_EXPECT_EQ(test, dev->size, 0UL);
+    KUNIT_EXPECT_TRUE(test, xa_empty(dev->qsets));
+    up_write(&dev->sem);
+
+    KUNIT_EXPECT_EQ(test, scull_test_io(dev, pos, &byte, 1, false), 0L);
+}
+
+static void scull_test_timing(struct kunit *test) {
+    static const unsigned long sizes[] = { 1UL << 20, 16UL << 20 };
+    struct scull_dev *dev = test->priv;
+    struct scull_microbench res;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+        KUNIT_ASSERT_EQ(test, scull_microbench_run(dev, sizes[i], &res), 0);
+        KUNIT_EXPECT_EQ(test, res.nquanta, (long)DIV_ROUND_UP(sizes[i], dev->layout->quantum));
+        kunit_info(test, "%lu KiB: alloc %llu ns/quantum, follow %llu ns, free %llu us, trim %llu us\n",
+                   sizes[i] >> 10, res.alloc_ns, res.follow_ns, res.free_us, res.trim_us);
+    }
+}
+
+static int scull_test_init(struct kunit *test) {
+    test->priv = scull_scratch_dev();
+    return test->priv ? 0 : -ENOMEM;
+}
+
+static void scull_test_exit(struct kunit *test) {
+    scull_scratch_free(test->priv);
+}
+
+static struct kunit_case scull_test_cases[] = {
+    KUNIT_CASE(scull_test_follow),
+    KUNIT_CASE(scull_test_offsets),
+    KUNIT_CASE(scull_test_boundaries),
+    KUNIT_CASE(scull_test_trim),
+    KUNIT_CASE(scull_test_timing),
+    {}
+};
+
+static struct kunit_suite scull_test_suite = {
+    .name       = "scull",
+    .init       = scull_test_init,
+    .exit       = scull_test_exit,
+    .test_cases = scull_test_cases,
+};
+
+kunit_test_suite(scull_test_suite);
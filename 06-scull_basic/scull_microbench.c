@@ -0,0 +1,174 @@
+#include "scull.h"
+#include <linux/seq_file.h>
+
+/**
+ * Microbenchmarks of the storage core. Reading
+ * /sys/kernel/debug/scull/microbench builds a scratch device of each
+ * size below with the default geometry, outside of any file, and
+ * times filling it, looking its quantum sets up and freeing it:
+ *
+ *   alloc_ns   per quantum, pointer arrays and sets included
+ *   follow_ns  per lookup of a set present, over a sweep of them all
+ *   free_us    freeing the tree in place on one CPU, the work the
+ *              background trim spreads over several
+ *   trim_us    detaching a tree as large, what the writer opening
+ *              the device waits for
+ *
+ * The free is timed in place rather than by draining the trim
+ * workqueue, which other devices share. The scratch device is charged
+ * and capped like any other: a size that doesn't fit under the caps
+ * fails with -ENOSPC rather than crowding the real devices out. The clock is only read around
+ * whole passes, the per-operation figures are averages. The KUnit
+ * suite in scull_kunit.c runs the same passes.
+ */
+static const unsigned long scull_microbench_sizes[] = { 1UL << 20, 16UL << 20, 64UL << 20 };
+
+#define SCULL_FOLLOW_PASSES 16
+
+/* a device with the default geometry that no file refers to */
+struct scull_dev *scull_scratch_dev(void) {
+    struct scull_dev *dev = kzalloc(sizeof(*dev), GFP_KERNEL);
+
+    if (!dev) {
+        return NULL;
+    }
+    dev->index = -1;
+    atomic_set(&dev->vmas, 0);
+    init_rwsem(&dev->sem);
+    init_rwsem(&dev->wsem);
+    if (scull_setup_storage(dev)) {
+        kfree(dev);
+        return NULL;
+    }
+    return dev;
+}
+
+/**
+ * Fill 'dev', locked for writing, to 'size' bytes, returns the quanta
+ * allocated or negative. A failed fill still leaves a tree to free.
+ */
+long scull_scratch_fill(struct scull_dev *dev, unsigned long size) {
+    struct scull_layout *layout = dev->layout;
+    unsigned long nquanta = DIV_ROUND_UP(size, layout->quantum), n;
+    struct scull_qset *dptr = NULL;
+    int i;
+
+    for (n = 0; n < nquanta; n++) {
+        i = n % layout->qset;
+        if (!i) {
+            dptr = scull_follow(dev, n / layout->qset, GFP_KERNEL);
+            if (!dptr) {
+                return -ENOMEM;
+            }
+            dptr->data = scull_alloc_qarray(layout, GFP_KERNEL);
+            if (!dptr->data) {
+                return -ENOMEM;
+            }
+        }
+        if (!scull_may_grow(dev)) {
+            return -ENOSPC;
+        }
+        dptr->data[i] = scull_alloc_quantum(layout, GFP_KERNEL);
+        if (!dptr->data[i]) {
+            return -ENOMEM;
+        }
+        dev->size = (n + 1) * layout->quantum;
+    }
+    return nquanta;
+}
+
+void scull_scratch_free(struct scull_dev *dev) {
+    down_write(&dev->sem);
+    scull_trim(dev);
+    up_write(&dev->sem);
+    scull_drain_storage();
+    scull_release_storage(dev);
+    kfree(dev);
+}
+
+/* free the tree of 'dev' without the trim workqueue */
+static void scull_microbench_free(struct scull_dev *dev) {
+    scull_free_qsets(dev->layout, dev->qsets, 0, ULONG_MAX);
+    xa_destroy(dev->qsets);
+    dev->size = 0;
+}
+
+/* time the passes on 'dev', empty and unlocked, at 'size' bytes */
+int scull_microbench_run(struct scull_dev *dev, unsigned long size, struct scull_microbench *res) {
+    unsigned long nitems, item;
+    u64 start, alloc, follow;
+    int pass, ret = 0;
+
+    down_write(&dev->sem);
+    start        = ktime_get_ns();
+    res->nquanta = scull_scratch_fill(dev, size);
+    alloc        = ktime_get_ns() - start;
+    if (res->nquanta < 0) {
+        ret = res->nquanta;
+        goto out;
+    }
+
+    nitems = DIV_ROUND_UP(res->nquanta, dev->layout->qset);
+    start  = ktime_get_ns();
+    for (pass = 0; pass < SCULL_FOLLOW_PASSES; pass++) {
+        for (item = 0; item < nitems; item++) {
+            if (!scull_follow(dev, item, GFP_KERNEL)) {
+                ret = -ENOMEM;
+                goto out;
+            }
+        }
+    }
+    follow = ktime_get_ns() - start;
+
+    start = ktime_get_ns();
+    scull_microbench_free(dev);
+    res->free_us = div_u64(ktime_get_ns() - start, NSEC_PER_USEC);
+
+    /* a tree to detach again, its free happens in the background */
+    ret = scull_scratch_fill(dev, size);
+    if (ret < 0) {
+        goto out;
+    }
+    ret = 0;
+    start = ktime_get_ns();
+    scull_trim(dev);
+    res->trim_us = div_u64(ktime_get_ns() - start, NSEC_PER_USEC);
+
+    res->alloc_ns  = div64_u64(alloc, res->nquanta);
+    res->follow_ns = div64_u64(follow, nitems * SCULL_FOLLOW_PASSES);
+out:
+    scull_trim(dev);
+    up_write(&dev->sem);
+    return ret;
+}
+
+static int scull_microbench_show(struct seq_file *m, void *v) {
+    struct scull_microbench res;
+    struct scull_dev *dev;
+    int i, ret = 0;
+
+    dev = scull_scratch_dev();
+    if (!dev) {
+        return -ENOMEM;
+    }
+    seq_printf(m, "%10s %8s %6s %10s %8s %10s %10s %10s\n",
+               "size_kb", "quantum", "qset", "quanta", "alloc_ns", "follow_ns", "free_us", "trim_us");
+    for (i = 0; i < ARRAY_SIZE(scull_microbench_sizes); i++) {
+        ret = scull_microbench_run(dev, scull_microbench_sizes[i], &res);
+        if (ret) {
+            break;
+        }
+        seq_printf(m, "%10lu %8d %6d %10ld %8llu %10llu %10llu %10llu\n",
+                   scull_microbench_sizes[i] >> 10, dev->layout->quantum, dev->layout->qset,
+                   res.nquanta, res.alloc_ns, res.follow_ns, res.free_us, res.trim_us);
+        cond_resched();
+    }
+    scull_scratch_free(dev);
+    return ret;
+}
+
+DEFINE_SHOW_ATTRIBUTE(scull_microbench);
+
+void scull_microbench_init(struct dentry *dir) {
+    debugfs_create_file("microbench", 0400, dir, NULL, &scull_microbench_fops);
+}
@@ -0,0 +1,186 @@
+#include "scull.h"
+
+/**
+ * Memory mapping of scull devices. Only devices using the page storage
+ * engine can be mapped: every quantum is then one or more whole pages,
+ * so a fault resolves its page through the quantum sets directly.
+ */
+
+static void scull_vma_open(struct vm_area_struct *vma) {
+    struct scull_dev *dev = vma->vm_private_data;
+
+    atomic_inc(&dev->vmas);
+}
+
+static void scull_vma_close(struct vm_area_struct *vma) {
+    struct scull_dev *dev = vma->vm_private_data;
+
+    atomic_dec(&dev->vmas);
+}
+
+/**
+ * Whether quantum 'i' of 'dptr', locked, can be mapped as it is: it
+ * is there, plain, and neither it nor its set is shared.
+ */
+static bool scull_vma_ready(struct scull_dev *dev, struct scull_qset *dptr, int i) {
+    void *quantum = dptr->data ? dptr->data[i] : NULL;
+
+    return quantum && !scull_quantum_compressed(quantum) && refcount_read(&dptr->refs) == 1 &&
+           !scull_quantum_shared(dev->layout, quantum);
+}
+
+/* the page at 'offset' of quantum 'i' of 'dptr', with a reference for the mapping */
+static struct page *scull_vma_page(struct scull_dev *dev, struct scull_qset *dptr, int i,
+                                   unsigned long offset) {
+    struct page *page = virt_to_page(dptr->data[i] + offset % dev->layout->quantum);
+
+    /* trimmed pages stay valid while mapped */
+    get_page(page);
+    return page;
+}
+
+/**
+ * Find the quantum backing the faulting page. Holes are filled in,
+ * as a shared writable mapping installs writable entries even for
+ * read faults; a write fault past the end grows the device. Quanta
+ * still shared with a snapshot are copied first, like on write().
+ *
+ * Faults share the device lock like writers do. A page already in
+ * place only takes its set shared, so mapped readers scan in
+ * parallel; filling or copying a quantum takes the set exclusive.
+ */
+static vm_fault_t scull_vma_fault(struct vm_fault *vmf) {
+    struct scull_dev *dev = vmf->vma->vm_private_data;
+    unsigned long offset = vmf->pgoff << PAGE_SHIFT;
+    struct scull_qset *dptr, *clone;
+    struct page *page;
+    vm_fault_t retval = VM_FAULT_SIGBUS;
+
+    long item;
+    int s_pos, itemsize;
+
+    down_read(&dev->sem);
+
+    /* the engine can't change while mapped, but check anyway */
+    if (!dev->layout->engine->mappable) {
+        goto out;
+    }
+    if (offset >= READ_ONCE(dev->size) && !(vmf->flags & FAULT_FLAG_WRITE)) {
+        goto out; /* out of range */
+    }
+
+    itemsize = dev->layout->quantum * dev->layout->qset;
+    item  = (long)offset / itemsize;
+    s_pos = (offset % itemsize) / dev->layout->quantum;
+
+    dptr = xa_load(dev->qsets, item);
+    if (dptr) {
+        page = NULL;
+        down_read(&dptr->sem);
+        if (scull_vma_ready(dev, dptr, s_pos)) {
+            page = scull_vma_page(dev, dptr, s_pos, offset);
+        }
+        up_read(&dptr->sem);
+        if (page) {
+            goto found;
+        }
+    }
+
+    for (;;) {
+        dptr = scull_follow(dev, item, GFP_KERNEL);
+        if (dptr == NULL) {
+            retval = VM_FAULT_OOM;
+            goto out;
+        }
+        down_write(&dptr->sem);
+        /* a writer unshared it meanwhile, look it up again */
+        if (xa_load(dev->qsets, item) == dptr) {
+            break;
+        }
+        up_write(&dptr->sem);
+    }
+    clone = scull_unshare_qset(dev, item, dptr, GFP_KERNEL);
+    if (clone == NULL) {
+        retval = VM_FAULT_OOM;
+        goto out_unlock;
+    }
+    dptr = clone;
+
+    if (!dptr->data) {
+        dptr->data = scull_alloc_qarray(dev->layout, GFP_KERNEL);
+        if (!dptr->data) {
+            retval = VM_FAULT_OOM;
+            goto out_unlock;
+        }
+    }
+    if (!dptr->data[s_pos]) {
+        /* over its cap, as a file system out of space would */
+        if (!scull_may_grow(dev)) {
+            goto out_unlock;
+        }
+        dptr->data[s_pos] = scull_alloc_quantum(dev->layout, GFP_KERNEL);
+        if (!dptr->data[s_pos]) {
+            retval = VM_FAULT_OOM;
+            goto out_unlock;
+        }
+    } else if (scull_unshare_quantum(dev->layout, dptr, s_pos, GFP_KERNEL)) {
+        retval = VM_FAULT_OOM;
+        goto out_unlock;
+    }
+    /* the set and the quantum are private and plain now */
+    page = scull_vma_page(dev, dptr, s_pos, offset);
+    up_write(&dptr->sem);
+
+found:
+    scull_extend_size(dev, offset + PAGE_SIZE);
+    vmf->page = page;
+    retval = 0;
+    goto out;
+
+out_unlock:
+    up_write(&dptr->sem);
+out:
+    up_read(&dev->sem);
+    return retval;
+}
+
+static const struct vm_operations_struct scull_vm_ops = {
+    .open  = scull_vma_open,
+    .close = scull_vma_close,
+    .fault = scull_vma_fault,
+};
+
+int scull_mmap(struct file *filp, struct vm_area_struct *vma) {
+    struct scull_dev *dev = filp->private_data;
+    int retval;
+
+    /* faults only ever see the data in memory */
+    retval = scull_backing_wait(dev);
+    if (retval) {
+        return retval;
+    }
+    /* no new mappings while a reshape moves the pages */
+    if (down_read_killable(&dev->wsem)) {
+        return -ERESTARTSYS;
+    }
+    if (down_write_killable(&dev->sem)) {
+        up_read(&dev->wsem);
+        return -ERESTARTSYS;
+    }
+
+    /* quanta must be whole pages, see the scull_storage parameter */
+    if (!dev->layout->engine->mappable) {
+        up_write(&dev->sem);
+        up_read(&dev->wsem);
+        return -ENODEV;
+    }
+
+    vma->vm_ops = &scull_vm_ops;
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+    vma->vm_private_data = dev;
+    scull_vma_open(vma); /* pins the geometry, see scull_trim() */
+
+    up_write(&dev->sem);
+    up_read(&dev->wsem);
+    return 0;
+}
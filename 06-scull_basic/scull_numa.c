@@ -0,0 +1,111 @@
+#include "scull.h"
+
+char *scull_numa = "local";
+int scull_numa_node;
+
+/**
+ * NUMA placement. Each device picks the node its quanta, pointer
+ * arrays and quantum sets come from: the one of the CPU allocating
+ * them (what the allocators do anyway), round-robin over the nodes
+ * with memory, or a single node, without falling back to the others.
+ * A reader on another node then pays for remote memory on every
+ * copy, so producers and consumers sharing a socket want local or
+ * bind, and readers spread all over want interleave.
+ */
+static const char * const scull_numa_names[] = {
+    [SCULL_NUMA_LOCAL]      = "local",
+    [SCULL_NUMA_INTERLEAVE] = "interleave",
+    [SCULL_NUMA_BIND]       = "bind",
+};
+
+static int scull_default_numa;
+
+static bool scull_valid_node(int node) {
+    return node >= 0 && node < nr_node_ids && node_state(node, N_MEMORY);
+}
+
+/* node for the next allocation, adding what 'gfp' needs to stay there */
+int scull_place(struct scull_placement *placement, gfp_t *gfp) {
+    int node;
+
+    switch (READ_ONCE(placement->policy)) {
+        case SCULL_NUMA_INTERLEAVE:
+            /* racing allocations may land on the same node, no matter */
+            node = next_node_in(READ_ONCE(placement->last), node_states[N_MEMORY]);
+            WRITE_ONCE(placement->last, node);
+            return node;
+
+        case SCULL_NUMA_BIND:
+            *gfp |= __GFP_THISNODE;
+            return READ_ONCE(placement->node);
+
+        default:
+            return NUMA_NO_NODE;
+    }
+}
+
+int scull_set_placement(struct scull_dev *dev, int policy, int node) {
+    if (policy < 0 || policy >= ARRAY_SIZE(scull_numa_names)) {
+        return -EINVAL;
+    }
+    if (policy == SCULL_NUMA_BIND && !scull_valid_node(node)) {
+        return -EINVAL;
+    }
+    /* the node first, a racing allocation must not bind to a stale one */
+    WRITE_ONCE(dev->placement.node, node);
+    WRITE_ONCE(dev->placement.policy, policy);
+    return 0;
+}
+
+void scull_numa_setup(struct scull_dev *dev) {
+    dev->placement.policy = scull_default_numa;
+    dev->placement.node   = scull_numa_node;
+    dev->placement.last   = NUMA_NO_NODE;
+}
+
+/**
+ * Sum up the bytes of the quanta of 'dev' by the node they sit on into
+ * 'bytes', nr_node_ids entries. Walks the whole device.
+ */
+int scull_numa_usage(struct scull_dev *dev, u64 *bytes) {
+    struct scull_layout *layout;
+    struct scull_qset *dptr;
+    unsigned long item;
+    void *quantum;
+    int i;
+
+    if (down_read_killable(&dev->sem)) {
+        return -ERESTARTSYS;
+    }
+    layout = dev->layout;
+    xa_for_each(dev->qsets, item, dptr) {
+        /* the compressor and the shrinker swap quanta under this */
+        down_read(&dptr->sem);
+        for (i = 0; dptr->data && i < layout->qset; i++) {
+            quantum = (void *)((unsigned long)dptr->data[i] & ~SCULL_ZQUANTUM);
+            if (quantum) {
+                bytes[page_to_nid(virt_to_page(quantum))] +=
+                    scull_quantum_size(layout, dptr->data[i]);
+            }
+        }
+        up_read(&dptr->sem);
+        cond_resched();
+    }
+    up_read(&dev->sem);
+    return 0;
+}
+
+int scull_numa_init(void) {
+    int ret = match_string(scull_numa_names, ARRAY_SIZE(scull_numa_names), scull_numa);
+
+    if (ret < 0) {
+        pr_err("Unknown NUMA placement '%s'\n", scull_numa);
+        return -EINVAL;
+    }
+    if (ret == SCULL_NUMA_BIND && !scull_valid_node(scull_numa_node)) {
+        pr_err("Invalid scull_numa_node %d\n", scull_numa_node);
+        return -EINVAL;
+    }
+    scull_default_numa = ret;
+    return 0;
+}
@@ -0,0 +1,232 @@
+#include "scull.h"
+
+unsigned long scull_dev_limit;
+unsigned long scull_total_limit;
+char *scull_shrink = "none";
+int scull_default_shrink;
+
+/**
+ * Memory caps and reclaim. Every device counts the bytes its quanta
+ * take up, plain or compressed, and so does the module as a whole;
+ * a write needing a new quantum past either cap fails with -ENOSPC,
+ * and so does one reading a quantum back from the image being
+ * restored. A reshape is charged for its copy as well: both trees
+ * count until the swap, so a device past half its cap can't reshape.
+ *
+ * Some allocations are not refused, so that data already written is
+ * never lost and an overwrite never fails for lack of room:
+ *   - copies unsharing a quantum with a snapshot or a dedup merge;
+ *   - decompressing a quantum to write into it;
+ *   - the background restore of an image.
+ * They still count, the next new quantum is refused instead. Racing
+ * writers may also each overshoot a cap by a quantum.
+ *
+ * Under memory pressure a shrinker walks the devices that allow it:
+ * with the compress policy their quanta are compressed in place, with
+ * the drop policy those that can be rebuilt are freed: quanta of zeros,
+ * which read back the same as a hole, and while an image is restored,
+ * quanta not written since they were read from it, which are read in
+ * again. Data written by users is never dropped. Both skip mapped
+ * devices, sets shared with a snapshot and sets being written.
+ */
+struct percpu_counter scull_usage;
+
+static LIST_HEAD(scull_shrink_devs);
+static DEFINE_MUTEX(scull_shrink_lock);
+
+static const char * const scull_shrink_names[] = {
+    [SCULL_SHRINK_NONE]     = "none",
+    [SCULL_SHRINK_COMPRESS] = "compress",
+    [SCULL_SHRINK_DROP]     = "drop",
+};
+
+/* whether 'dev' may take another quantum */
+bool scull_may_grow(struct scull_dev *dev) {
+    s64 quantum = dev->layout->quantum;
+    unsigned long limit = READ_ONCE(dev->limit);
+
+    if (limit && percpu_counter_compare(&dev->usage, (s64)limit - quantum) > 0) {
+        return false;
+    }
+    if (scull_total_limit &&
+        percpu_counter_compare(&scull_usage, (s64)scull_total_limit - quantum) > 0) {
+        return false;
+    }
+    return true;
+}
+
+int scull_set_shrink(struct scull_dev *dev, unsigned long policy) {
+    if (policy >= ARRAY_SIZE(scull_shrink_names)) {
+        return -EINVAL;
+    }
+    if (policy == SCULL_SHRINK_COMPRESS && !scull_can_compress()) {
+        return -EOPNOTSUPP;
+    }
+    WRITE_ONCE(dev->shrink, policy);
+    return 0;
+}
+
+/* whether quantum 'i' of 'dptr', number 'n', can be freed without losing data */
+static bool scull_shrink_droppable(struct scull_dev *dev, struct scull_qset *dptr, int i,
+                                   unsigned long n) {
+    void *quantum = dptr->data[i];
+
+    if (scull_backing_evict(dev, n)) {
+        return true;
+    }
+    return !scull_quantum_compressed(quantum) && !memchr_inv(quantum, 0, dev->layout->quantum);
+}
+
+/**
+ * Free up to 'goal' bytes of 'dev', resuming where the last pass
+ * stopped so the whole device gets its turn. Reclaim must not wait on
+ * our locks: whatever is taken is skipped.
+ */
+static unsigned long scull_shrink_dev(struct scull_dev *dev, unsigned long goal) {
+    int policy = READ_ONCE(dev->shrink);
+    struct scull_layout *layout;
+    struct scull_qset *dptr;
+    unsigned long item, freed = 0;
+    void *buf = NULL;
+    int i;
+
+    if (policy == SCULL_SHRINK_NONE || !down_read_trylock(&dev->sem)) {
+        return 0;
+    }
+    layout = dev->layout;
+    if (atomic_read(&dev->vmas)) {
+        goto out;
+    }
+    if (policy == SCULL_SHRINK_COMPRESS) {
+        buf = kmalloc(layout->quantum, GFP_NOWAIT | __GFP_NOWARN);
+        if (!buf) {
+            goto out;
+        }
+    }
+
+    item = dev->shrink_next;
+    for (dptr = xa_find(dev->qsets, &item, ULONG_MAX, XA_PRESENT); dptr && freed < goal;
+         dptr = xa_find_after(dev->qsets, &item, ULONG_MAX, XA_PRESENT)) {
+        if (!down_write_trylock(&dptr->sem)) {
+            continue;
+        }
+        if (dptr->data && refcount_read(&dptr->refs) == 1) {
+            for (i = 0; i < layout->qset && freed < goal; i++) {
+                /* a shared quantum frees nothing */
+                if (!dptr->data[i] || scull_quantum_shared(layout, dptr->data[i])) {
+                    continue;
+                }
+                if (policy == SCULL_SHRINK_DROP) {
+                    if (scull_shrink_droppable(dev, dptr, i, item * layout->qset + i)) {
+                        freed += scull_quantum_size(layout, dptr->data[i]);
+                        scull_put_quantum(layout, dptr, i);
+                    }
+                } else if (!scull_quantum_compressed(dptr->data[i])) {
+                    freed += scull_deflate_quantum(layout, dptr, i, buf,
+                                                   GFP_NOWAIT | __GFP_NOWARN);
+                }
+            }
+        }
+        up_write(&dptr->sem);
+    }
+    /* stopped short of the end: start there next time */
+    dev->shrink_next = dptr ? item : 0;
+
+out:
+    up_read(&dev->sem);
+    kfree(buf);
+    return freed;
+}
+
+/* objects are pages' worth of quanta on devices that allow reclaim */
+static unsigned long scull_shrink_count(struct shrinker *shrinker, struct shrink_control *sc) {
+    struct scull_dev *dev;
+    unsigned long count = 0;
+
+    mutex_lock(&scull_shrink_lock);
+    list_for_each_entry(dev, &scull_shrink_devs, shrink_list) {
+        if (READ_ONCE(dev->shrink) != SCULL_SHRINK_NONE) {
+            count += percpu_counter_read_positive(&dev->usage) >> PAGE_SHIFT;
+        }
+    }
+    mutex_unlock(&scull_shrink_lock);
+    return count;
+}
+
+static unsigned long scull_shrink_scan(struct shrinker *shrinker, struct shrink_control *sc) {
+    unsigned long goal = sc->nr_to_scan << PAGE_SHIFT, freed = 0;
+    struct scull_dev *dev;
+
+    if (!mutex_trylock(&scull_shrink_lock)) {
+        return SHRINK_STOP;
+    }
+    list_for_each_entry(dev, &scull_shrink_devs, shrink_list) {
+        if (freed >= goal) {
+            break;
+        }
+        freed += scull_shrink_dev(dev, goal - freed);
+    }
+    /* the next pass starts with another device */
+    if (!list_empty(&scull_shrink_devs)) {
+        list_rotate_left(&scull_shrink_devs);
+    }
+    mutex_unlock(&scull_shrink_lock);
+
+    return freed ? freed >> PAGE_SHIFT : SHRINK_STOP;
+}
+
+static struct shrinker scull_shrinker = {
+    .count_objects = scull_shrink_count,
+    .scan_objects  = scull_shrink_scan,
+    .seeks         = DEFAULT_SEEKS,
+};
+
+int scull_shrink_add_dev(struct scull_dev *dev) {
+    int ret = percpu_counter_init(&dev->usage, 0, GFP_KERNEL);
+
+    if (ret) {
+        return ret;
+    }
+    dev->limit       = scull_dev_limit;
+    dev->shrink      = scull_default_shrink;
+    dev->shrink_next = 0;
+
+    mutex_lock(&scull_shrink_lock);
+    list_add_tail(&dev->shrink_list, &scull_shrink_devs);
+    mutex_unlock(&scull_shrink_lock);
+    return 0;
+}
+
+/* once this returns the shrinker no longer looks at 'dev' */
+void scull_shrink_del_dev(struct scull_dev *dev) {
+    mutex_lock(&scull_shrink_lock);
+    list_del(&dev->shrink_list);
+    mutex_unlock(&scull_shrink_lock);
+    percpu_counter_destroy(&dev->usage);
+}
+
+int scull_shrink_init(void) {
+    int ret;
+
+    ret = match_string(scull_shrink_names, ARRAY_SIZE(scull_shrink_names), scull_shrink);
+    if (ret < 0) {
+        pr_err("Unknown shrink policy '%s'\n", scull_shrink);
+        return -EINVAL;
+    }
+    scull_default_shrink = ret;
+
+    ret = percpu_counter_init(&scull_usage, 0, GFP_KERNEL);
+    if (ret) {
+        return ret;
+    }
+    ret = register_shrinker(&scull_shrinker);
+    if (ret) {
+        percpu_counter_destroy(&scull_usage);
+    }
+    return ret;
+}
+
+void scull_shrink_exit(void) {
+    unregister_shrinker(&scull_shrinker);
+    percpu_counter_destroy(&scull_usage);
+}
@@ -0,0 +1,172 @@
+#include "scull.h"
+#include <linux/anon_inodes.h>
+
+/**
+ * Copy-on-write snapshots. A snapshot is a second tree holding a
+ * reference to each quantum set of the device at the time it was
+ * taken, so taking one costs O(quantum sets) and copies no data.
+ * Writers unshare a set before modifying it (scull_unshare_qset())
+ * and a quantum before writing into it (scull_unshare_quantum()), so
+ * whatever a snapshot holds never changes and it is read lock-free.
+ */
+struct scull_snap {
+    struct scull_dev *dev;
+    struct xarray qsets;
+    struct scull_layout *layout;    /* the one its sets were built with */
+    unsigned long size;
+};
+
+static void scull_snap_free(struct scull_snap *snap) {
+    struct scull_dev *dev = snap->dev;
+    struct scull_qset *dptr;
+    unsigned long item;
+
+    /*
+     * Readers of the device may still hold a set a writer has just
+     * unshared, keep them out while the snapshot drops its sets.
+     */
+    down_write(&dev->sem);
+    xa_for_each(&snap->qsets, item, dptr) {
+        scull_put_qset(snap->layout, dptr);
+    }
+    up_write(&dev->sem);
+
+    xa_destroy(&snap->qsets);
+    scull_put_layout(snap->layout);
+    kfree(snap);
+    scull_put_dev(dev);
+}
+
+static ssize_t scull_snap_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+    struct scull_snap *snap = iocb->ki_filp->private_data;
+    struct scull_qset *dptr;
+
+    int quantum  = snap->layout->quantum;
+    int itemsize = quantum * snap->layout->qset;
+    int remained, s_pos, q_pos;
+    size_t chunk, copied, done = 0;
+    size_t count = iov_iter_count(to);
+    loff_t pos = iocb->ki_pos;
+    void *src, *plain;
+
+    if (pos >= snap->size) {
+        return 0;
+    }
+    if (pos + count > snap->size) {
+        count = snap->size - pos;
+    }
+
+    while (done < count) {
+        dptr     = xa_load(&snap->qsets, (long)pos / itemsize);
+        remained = (long)pos % itemsize;
+        s_pos    = remained / quantum;
+        q_pos    = remained % quantum;
+
+        src = (dptr && dptr->data) ? dptr->data[s_pos] : NULL;
+        plain = NULL;
+        if (src && scull_quantum_compressed(src)) {
+            src = plain = scull_inflate_quantum(snap->layout, src, GFP_KERNEL);
+            if (!plain) {
+                return done ? done : -ENOMEM;
+            }
+        }
+
+        /* holes read back as zeros, as on the device */
+        chunk = min_t(size_t, count - done, quantum - q_pos);
+        if (src) {
+            copied = copy_to_iter(src + q_pos, chunk, to);
+        } else {
+            copied = iov_iter_zero(chunk, to);
+        }
+        kvfree(plain);
+
+        pos  += copied;
+        done += copied;
+        if (copied < chunk) {
+            break;
+        }
+    }
+    iocb->ki_pos = pos;
+
+    return done ? done : -EFAULT;
+}
+
+static loff_t scull_snap_llseek(struct file *filp, loff_t offset, int whence) {
+    struct scull_snap *snap = filp->private_data;
+
+    return fixed_size_llseek(filp, offset, whence, snap->size);
+}
+
+static int scull_snap_release(struct inode *inode, struct file *filp) {
+    scull_snap_free(filp->private_data);
+    return 0;
+}
+
+/* splice lets a backup stream a snapshot straight to disk */
+static const struct file_operations scull_snap_fops = {
+    .owner       = THIS_MODULE,
+    .read_iter   = scull_snap_read_iter,
+    .splice_read = generic_file_splice_read,
+    .llseek      = scull_snap_llseek,
+    .release     = scull_snap_release,
+};
+
+/**
+ * Take a snapshot of 'dev' and return a read-only file descriptor on
+ * it. Writers are held off only while the sets are referenced. A
+ * mapped device can't be snapshotted, stores through the mapping
+ * would bypass the copy-on-write.
+ */
+int scull_snapshot(struct scull_dev *dev) {
+    struct scull_snap *snap;
+    struct scull_qset *dptr;
+    unsigned long item;
+    int fd;
+
+    /* sets are shared as they are, holes and all */
+    fd = scull_backing_wait(dev);
+    if (fd) {
+        return fd;
+    }
+    snap = kzalloc(sizeof(*snap), GFP_KERNEL);
+    if (!snap) {
+        return -ENOMEM;
+    }
+    /* the file it is taken through holds the device, so can we */
+    atomic_inc(&dev->users);
+    snap->dev = dev;
+    xa_init(&snap->qsets);
+
+    if (down_write_killable(&dev->sem)) {
+        kfree(snap);
+        scull_put_dev(dev);
+        return -ERESTARTSYS;
+    }
+    if (atomic_read(&dev->vmas)) {
+        up_write(&dev->sem);
+        kfree(snap);
+        scull_put_dev(dev);
+        return -EBUSY;
+    }
+    snap->layout = dev->layout;
+    scull_get_layout(snap->layout);
+    snap->size = dev->size;
+
+    fd = 0;
+    xa_for_each(dev->qsets, item, dptr) {
+        if (xa_is_err(xa_store(&snap->qsets, item, dptr, GFP_KERNEL))) {
+            fd = -ENOMEM;
+            break;
+        }
+        refcount_inc(&dptr->refs);
+    }
+    up_write(&dev->sem);
+
+    if (fd == 0) {
+        fd = anon_inode_getfd("[scull-snapshot]", &scull_snap_fops, snap, O_RDONLY | O_CLOEXEC);
+    }
+    if (fd < 0) {
+        scull_snap_free(snap);
+    }
+    return fd;
+}
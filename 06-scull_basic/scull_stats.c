@@ -0,0 +1,214 @@
+#include "scull.h"
+
+/**
+ * Operational counters. Each CPU bumps its own copy from the I/O
+ * paths; reading /sys/kernel/debug/scull/scullN sums them up. The sum
+ * is not a snapshot, counters keep moving while it is taken.
+ *
+ * Latency histograms of the read and write phases live next to them
+ * in scullN_latency; writing to that file clears them. They are only
+ * collected while 'latency' in the same directory reads 1.
+ */
+
+DEFINE_STATIC_KEY_FALSE(scull_hist_key);
+
+static struct dentry *scull_debugfs_dir;
+
+static const char * const scull_stat_names[SCULL_NR_STATS] = {
+    [SCULL_STAT_READ_BYTES]  = "read_bytes",
+    [SCULL_STAT_WRITE_BYTES] = "write_bytes",
+    [SCULL_STAT_ALLOCS]      = "allocs",
+    [SCULL_STAT_FREES]       = "frees",
+    [SCULL_STAT_TRIMS]       = "trims",
+    [SCULL_STAT_LOCK_WAITS]  = "lock_waits",
+    [SCULL_STAT_ENOMEM]      = "enomem",
+    [SCULL_STAT_ZBYTES_IN]   = "zbytes_in",
+    [SCULL_STAT_ZBYTES_OUT]  = "zbytes_out",
+    [SCULL_STAT_DECOMPRESSIONS] = "decompressions",
+    [SCULL_STAT_DECOMPRESS_NS]  = "decompress_ns",
+    [SCULL_STAT_DEDUP_ZERO]     = "dedup_zero",
+    [SCULL_STAT_DEDUP_MERGED]   = "dedup_merged",
+};
+
+static int scull_stats_show(struct seq_file *m, void *v) {
+    struct scull_dev *dev = m->private;
+    u64 sum[SCULL_NR_STATS] = { 0 };
+    s64 usage, logical;
+    int cpu, i;
+
+    for_each_possible_cpu(cpu) {
+        struct scull_stats *stats = per_cpu_ptr(dev->stats, cpu);
+
+        for (i = 0; i < SCULL_NR_STATS; i++) {
+            sum[i] += READ_ONCE(stats->count[i]);
+        }
+    }
+    for (i = 0; i < SCULL_NR_STATS; i++) {
+        seq_printf(m, "%-14s %llu\n", scull_stat_names[i], sum[i]);
+    }
+    /* in percent and nanoseconds, integer math only */
+    if (sum[SCULL_STAT_ZBYTES_OUT]) {
+        seq_printf(m, "%-14s %llu%%\n", "zratio",
+                   div64_u64(sum[SCULL_STAT_ZBYTES_IN] * 100, sum[SCULL_STAT_ZBYTES_OUT]));
+    }
+    if (sum[SCULL_STAT_DECOMPRESSIONS]) {
+        seq_printf(m, "%-14s %llu\n", "decompress_avg",
+                   div64_u64(sum[SCULL_STAT_DECOMPRESS_NS], sum[SCULL_STAT_DECOMPRESSIONS]));
+    }
+    /* bytes held in quanta now, and the cap on them */
+    usage = percpu_counter_sum(&dev->usage);
+    seq_printf(m, "%-14s %lld\n", "usage", usage);
+    seq_printf(m, "%-14s %lu\n", "limit", READ_ONCE(dev->limit));
+
+    /*
+     * What the quanta would take up if none were shared, by dedup or
+     * by snapshots, over what they take; the layout needs the lock.
+     */
+    if (down_read_killable(&dev->sem)) {
+        return -ERESTARTSYS;
+    }
+    logical = usage + atomic_long_read(&dev->layout->nshared) * dev->layout->quantum;
+    up_read(&dev->sem);
+    if (usage > 0) {
+        seq_printf(m, "%-14s %llu%%\n", "dedup_ratio", div64_u64(logical * 100, usage));
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(scull_stats);
+
+static const char * const scull_phase_names[SCULL_NR_PHASES] = {
+    [SCULL_PHASE_LOCK]   = "lock",
+    [SCULL_PHASE_FOLLOW] = "follow",
+    [SCULL_PHASE_ALLOC]  = "alloc",
+    [SCULL_PHASE_COPY]   = "copy",
+    [SCULL_PHASE_DECOMPRESS] = "decompress",
+};
+
+/* one line per phase and non-empty bucket, keyed by its lower bound */
+static int scull_latency_show(struct seq_file *m, void *v) {
+    struct scull_dev *dev = m->private;
+    u64 sum;
+    int cpu, phase, b;
+
+    for (phase = 0; phase < SCULL_NR_PHASES; phase++) {
+        seq_printf(m, "%s:\n", scull_phase_names[phase]);
+        for (b = 0; b < SCULL_HIST_BUCKETS; b++) {
+            sum = 0;
+            for_each_possible_cpu(cpu) {
+                sum += READ_ONCE(per_cpu_ptr(dev->stats, cpu)->hist[phase][b]);
+            }
+            if (sum) {
+                seq_printf(m, "  >= %10llu ns: %llu\n", b ? 1ULL << (b - 1) : 0, sum);
+            }
+        }
+    }
+    return 0;
+}
+
+/* bytes of quanta per node with memory */
+static int scull_numa_show(struct seq_file *m, void *v) {
+    struct scull_dev *dev = m->private;
+    u64 *bytes;
+    int node, ret;
+
+    bytes = kcalloc(nr_node_ids, sizeof(*bytes), GFP_KERNEL);
+    if (!bytes) {
+        return -ENOMEM;
+    }
+    ret = scull_numa_usage(dev, bytes);
+    if (!ret) {
+        for_each_node_state(node, N_MEMORY) {
+            seq_printf(m, "node%-10d %llu\n", node, bytes[node]);
+        }
+    }
+    kfree(bytes);
+    return ret;
+}
+DEFINE_SHOW_ATTRIBUTE(scull_numa);
+
+static int scull_latency_open(struct inode *inode, struct file *file) {
+    return single_open(file, scull_latency_show, inode->i_private);
+}
+
+/* any write clears the histograms, racing updates may survive it */
+static ssize_t scull_latency_write(struct file *file, const char __user *buf,
+                                   size_t count, loff_t *ppos) {
+    struct scull_dev *dev = ((struct seq_file *)file->private_data)->private;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        memset(per_cpu_ptr(dev->stats, cpu)->hist, 0, sizeof(dev->stats->hist));
+    }
+    return count;
+}
+
+static const struct file_operations scull_latency_fops = {
+    .owner   = THIS_MODULE,
+    .open    = scull_latency_open,
+    .read    = seq_read,
+    .write   = scull_latency_write,
+    .llseek  = seq_lseek,
+    .release = single_release,
+};
+
+static ssize_t scull_hist_key_read(struct file *file, char __user *buf,
+                                   size_t count, loff_t *ppos) {
+    char val[2] = { static_key_enabled(&scull_hist_key) ? '1' : '0', '\n' };
+
+    return simple_read_from_buffer(buf, count, ppos, val, sizeof(val));
+}
+
+static ssize_t scull_hist_key_write(struct file *file, const char __user *buf,
+                                    size_t count, loff_t *ppos) {
+    bool enable;
+    int ret = kstrtobool_from_user(buf, count, &enable);
+
+    if (ret) {
+        return ret;
+    }
+    if (enable) {
+        static_branch_enable(&scull_hist_key);
+    } else {
+        static_branch_disable(&scull_hist_key);
+    }
+    return count;
+}
+
+static const struct file_operations scull_hist_key_fops = {
+    .owner = THIS_MODULE,
+    .read  = scull_hist_key_read,
+    .write = scull_hist_key_write,
+};
+
+/* debugfs is optional, failures here are not fatal */
+void scull_stats_init(void) {
+    scull_debugfs_dir = debugfs_create_dir(SCULL_MODULE_NAME, NULL);
+    debugfs_create_file("latency", 0644, scull_debugfs_dir, NULL, &scull_hist_key_fops);
+    scull_microbench_init(scull_debugfs_dir);
+}
+
+void scull_stats_add_dev(struct scull_dev *dev, int index) {
+    char name[32];
+
+    snprintf(name, sizeof(name), SCULL_MODULE_NAME "%d", index);
+    dev->debugfs[0] = debugfs_create_file(name, 0444, scull_debugfs_dir, dev, &scull_stats_fops);
+    snprintf(name, sizeof(name), SCULL_MODULE_NAME "%d_latency", index);
+    dev->debugfs[1] = debugfs_create_file(name, 0644, scull_debugfs_dir, dev, &scull_latency_fops);
+    snprintf(name, sizeof(name), SCULL_MODULE_NAME "%d_numa", index);
+    dev->debugfs[2] = debugfs_create_file(name, 0444, scull_debugfs_dir, dev, &scull_numa_fops);
+}
+
+/* once this returns no reader of the files of 'dev' is left */
+void scull_stats_del_dev(struct scull_dev *dev) {
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(dev->debugfs); i++) {
+        debugfs_remove(dev->debugfs[i]);
+        dev->debugfs[i] = NULL;
+    }
+}
+
+void scull_stats_exit(void) {
+    debugfs_remove_recursive(scull_debugfs_dir);
+    static_branch_disable(&scull_hist_key);
+}
@@ -0,0 +1,965 @@
+#include "scull.h"
+
+int scull_mempool;
+char *scull_storage = "slab";
+int scull_page_order;
+
+/**
+ * Quanta and quantum set arrays come from dedicated slab caches, one
+ * per object size, shared by every device with the same geometry. A
+ * 400-byte quantum then costs 400 bytes instead of a kmalloc-512 slot
+ * and shows up under its own name in /proc/slabinfo.
+ */
+struct scull_cache {
+    struct list_head list;
+    struct kmem_cache *cachep;
+    size_t size;
+    int refs;
+    char name[32];
+};
+
+static LIST_HEAD(scull_caches);
+static DEFINE_MUTEX(scull_caches_lock);
+
+static struct kmem_cache *scull_qset_cachep;
+static mempool_t *scull_qset_pool;
+static struct workqueue_struct *scull_trim_wq;
+
+static struct kmem_cache *scull_cache_get(const char *prefix, size_t size) {
+    struct scull_cache *c;
+    struct kmem_cache *cachep = NULL;
+
+    mutex_lock(&scull_caches_lock);
+    list_for_each_entry(c, &scull_caches, list) {
+        if (c->size == size && !strncmp(c->name, prefix, strlen(prefix))) {
+            c->refs++;
+            cachep = c->cachep;
+            goto out;
+        }
+    }
+
+    c = kzalloc(sizeof(*c), GFP_KERNEL);
+    if (!c) {
+        goto out;
+    }
+    snprintf(c->name, sizeof(c->name), "%s%zu", prefix, size);
+    /*
+     * The whole object is copied to and from user space, so whitelist
+     * it for hardened usercopy; this also keeps the cache from being
+     * merged with others and hiding in /proc/slabinfo.
+     */
+    c->cachep = kmem_cache_create_usercopy(c->name, size, 0, 0, 0, size, NULL);
+    if (!c->cachep) {
+        kfree(c);
+        goto out;
+    }
+    c->size = size;
+    c->refs = 1;
+    list_add(&c->list, &scull_caches);
+    cachep = c->cachep;
+
+out:
+    mutex_unlock(&scull_caches_lock);
+    return cachep;
+}
+
+static void scull_cache_put(struct kmem_cache *cachep) {
+    struct scull_cache *c;
+
+    if (!cachep) {
+        return;
+    }
+
+    mutex_lock(&scull_caches_lock);
+    list_for_each_entry(c, &scull_caches, list) {
+        if (c->cachep == cachep) {
+            if (--c->refs == 0) {
+                list_del(&c->list);
+                kmem_cache_destroy(c->cachep);
+                kfree(c);
+            }
+            break;
+        }
+    }
+    mutex_unlock(&scull_caches_lock);
+}
+
+/**
+ * Allocate from a cache, dipping into the device reserve (if any)
+ * instead of failing. The reserve is never waited for: an empty one
+ * means -ENOMEM, as a plain allocation would, and it ignores 'node'.
+ * Objects are charged to the memory cgroup of the allocating task.
+ */
+static void *scull_cache_alloc(struct kmem_cache *cachep, mempool_t *pool, gfp_t gfp, int node) {
+    void *p;
+
+    gfp |= __GFP_ACCOUNT;
+    p = kmem_cache_alloc_node(cachep, gfp | (pool ? __GFP_NOWARN : 0), node);
+
+    if (!p && pool) {
+        p = mempool_alloc(pool, gfp & ~__GFP_DIRECT_RECLAIM);
+    }
+    return p;
+}
+
+static void scull_cache_free(struct kmem_cache *cachep, mempool_t *pool, void *p) {
+    if (pool) {
+        mempool_free(p, pool); /* refills the reserve first */
+    } else {
+        kmem_cache_free(cachep, p);
+    }
+}
+
+struct scull_qset *scull_alloc_qset(struct scull_layout *layout, gfp_t gfp) {
+    int node = scull_place(layout->placement, &gfp);
+    struct scull_qset *qs_data = scull_cache_alloc(scull_qset_cachep, scull_qset_pool, gfp, node);
+
+    if (qs_data) {
+        memset(qs_data, 0, sizeof(*qs_data));
+        init_rwsem(&qs_data->sem);
+        refcount_set(&qs_data->refs, 1);
+        qs_data->atime = jiffies;
+    }
+    return qs_data;
+}
+
+void scull_free_qset(struct scull_qset *qs_data) {
+    scull_cache_free(scull_qset_cachep, scull_qset_pool, qs_data);
+}
+
+void **scull_alloc_qarray(struct scull_layout *layout, gfp_t gfp) {
+    int node = scull_place(layout->placement, &gfp);
+    void **data = scull_cache_alloc(layout->qarray_cache, layout->qarray_pool, gfp, node);
+
+    if (data) {
+        memset(data, 0, layout->qset * sizeof(char *));
+        scull_stat_inc(layout->stats, SCULL_STAT_ALLOCS);
+    }
+    return data;
+}
+
+void scull_free_qarray(struct scull_layout *layout, void **data) {
+    scull_cache_free(layout->qarray_cache, layout->qarray_pool, data);
+    scull_stat_inc(layout->stats, SCULL_STAT_FREES);
+}
+
+/**
+ * Storage engines, selected at load time with scull_storage. The slab
+ * engine carves quanta of any size out of a dedicated cache. The page
+ * engine makes every quantum a zeroed compound page of
+ * PAGE_SIZE << scull_page_order bytes: it can be mapped into user
+ * space, and a large quantum is freed in one go.
+ */
+static void *scull_slab_alloc_quantum(struct scull_layout *layout, gfp_t gfp, int node) {
+    void *quantum = scull_cache_alloc(layout->quantum_cache, layout->quantum_pool, gfp, node);
+
+    /* unwritten parts of a quantum must read back as zeros */
+    if (quantum) {
+        memset(quantum, 0, layout->quantum);
+    }
+    return quantum;
+}
+
+static void scull_slab_free_quantum(struct scull_layout *layout, void *quantum) {
+    scull_cache_free(layout->quantum_cache, layout->quantum_pool, quantum);
+}
+
+static int scull_slab_setup(struct scull_layout *layout) {
+    layout->quantum_cache = scull_cache_get("scull_quantum_", layout->quantum);
+    if (!layout->quantum_cache) {
+        return -ENOMEM;
+    }
+    if (scull_mempool > 0) {
+        layout->quantum_pool = mempool_create_slab_pool(scull_mempool, layout->quantum_cache);
+        if (!layout->quantum_pool) {
+            return -ENOMEM;
+        }
+    }
+    return 0;
+}
+
+static void scull_slab_release(struct scull_layout *layout) {
+    mempool_destroy(layout->quantum_pool);
+    scull_cache_put(layout->quantum_cache);
+    layout->quantum_pool  = NULL;
+    layout->quantum_cache = NULL;
+}
+
+static void *scull_page_pool_alloc(gfp_t gfp, void *pool_data) {
+    return alloc_pages(gfp | __GFP_COMP, (long)pool_data);
+}
+
+static void scull_page_pool_free(void *element, void *pool_data) {
+    __free_pages(element, (long)pool_data);
+}
+
+/* pages are charged to the memory cgroup of the allocating task, as objects are */
+static void *scull_page_alloc_quantum(struct scull_layout *layout, gfp_t gfp, int node) {
+    int order = get_order(layout->quantum);
+    struct page *page;
+
+    gfp |= __GFP_ACCOUNT;
+    page = alloc_pages_node(node, gfp | __GFP_COMP | __GFP_ZERO |
+                            (layout->quantum_pool ? __GFP_NOWARN : 0), order);
+    if (!page && layout->quantum_pool) {
+        page = mempool_alloc(layout->quantum_pool, gfp & ~__GFP_DIRECT_RECLAIM);
+        if (page) {
+            memset(page_address(page), 0, layout->quantum);
+        }
+    }
+    return page ? page_address(page) : NULL;
+}
+
+static void scull_page_free_quantum(struct scull_layout *layout, void *quantum) {
+    struct page *page = virt_to_page(quantum);
+
+    /* a page still referenced elsewhere must not go back to the reserve */
+    if (layout->quantum_pool && page_ref_count(page) == 1) {
+        mempool_free(page, layout->quantum_pool);
+    } else {
+        put_page(page);
+    }
+}
+
+static int scull_page_setup(struct scull_layout *layout) {
+    if (scull_mempool > 0) {
+        layout->quantum_pool = mempool_create(scull_mempool, scull_page_pool_alloc,
+                                scull_page_pool_free, (void *)(long)get_order(layout->quantum));
+        if (!layout->quantum_pool) {
+            return -ENOMEM;
+        }
+    }
+    return 0;
+}
+
+static void scull_page_release(struct scull_layout *layout) {
+    mempool_destroy(layout->quantum_pool);
+    layout->quantum_pool = NULL;
+}
+
+static const struct scull_engine scull_slab_engine = {
+    .name          = "slab",
+    .alloc_quantum = scull_slab_alloc_quantum,
+    .free_quantum  = scull_slab_free_quantum,
+    .setup         = scull_slab_setup,
+    .release       = scull_slab_release,
+};
+
+static const struct scull_engine scull_page_engine = {
+    .name          = "page",
+    .mappable      = true,
+    .alloc_quantum = scull_page_alloc_quantum,
+    .free_quantum  = scull_page_free_quantum,
+    .setup         = scull_page_setup,
+    .release       = scull_page_release,
+};
+
+const struct scull_engine *scull_default_engine = &scull_slab_engine;
+
+void *scull_alloc_quantum(struct scull_layout *layout, gfp_t gfp) {
+    int node = scull_place(layout->placement, &gfp);
+    void *quantum = layout->engine->alloc_quantum(layout, gfp, node);
+
+    if (quantum) {
+        scull_stat_inc(layout->stats, SCULL_STAT_ALLOCS);
+        scull_account(layout, layout->quantum);
+    }
+    return quantum;
+}
+
+/* bytes 'quantum' takes up, plain or compressed */
+size_t scull_quantum_size(struct scull_layout *layout, const void *quantum) {
+    return scull_quantum_compressed(quantum) ? scull_zquantum_size(quantum) : layout->quantum;
+}
+
+void scull_free_quantum(struct scull_layout *layout, void *quantum) {
+    scull_account(layout, -(s64)scull_quantum_size(layout, quantum));
+    if (scull_quantum_compressed(quantum)) {
+        scull_free_zquantum(quantum);
+    } else {
+        layout->engine->free_quantum(layout, quantum);
+    }
+    scull_stat_inc(layout->stats, SCULL_STAT_FREES);
+}
+
+/**
+ * Quanta shared between a device and its snapshots. The layout counts
+ * the extra owners of each shared quantum in a hash table keyed by its
+ * address, which grows and shrinks with the number of them. A quantum
+ * missing from the table has a single owner: whether a quantum is
+ * shared is always read from the table, never remembered by its sets,
+ * so it goes back to being private as soon as the last other owner
+ * lets go. Updates take the layout's share_lock, and so do lookups,
+ * so an entry can be freed as soon as it is removed. A layout sharing
+ * nothing skips the table altogether.
+ */
+struct scull_share {
+    struct rhash_head node;
+    void *quantum;
+    unsigned long owners;       /* extra ones */
+};
+
+static const struct rhashtable_params scull_share_params = {
+    .key_len     = sizeof(void *),
+    .key_offset  = offsetof(struct scull_share, quantum),
+    .head_offset = offsetof(struct scull_share, node),
+    .automatic_shrinking = true,
+};
+
+static void scull_share_free(void *ptr, void *arg) {
+    kfree(ptr);
+}
+
+/* add an owner to 'quantum' */
+int scull_share_quantum(struct scull_layout *layout, void *quantum, gfp_t gfp) {
+    struct scull_share *share, *fresh = NULL;
+    int ret = 0;
+
+    for (;;) {
+        spin_lock(&layout->share_lock);
+        share = rhashtable_lookup_fast(&layout->shared, &quantum, scull_share_params);
+        if (share) {
+            share->owners++;
+            break;
+        }
+        if (fresh) {
+            ret = rhashtable_insert_fast(&layout->shared, &fresh->node, scull_share_params);
+            if (!ret) {
+                fresh = NULL;
+            }
+            break;
+        }
+        spin_unlock(&layout->share_lock);
+
+        /* the first extra owner, allocate its entry and look again */
+        fresh = kmalloc(sizeof(*fresh), gfp);
+        if (!fresh) {
+            return -ENOMEM;
+        }
+        fresh->quantum = quantum;
+        fresh->owners  = 1;
+    }
+    if (!ret) {
+        atomic_long_inc(&layout->nshared);
+    }
+    spin_unlock(&layout->share_lock);
+    kfree(fresh);
+    return ret;
+}
+
+/* whether 'quantum' has other owners */
+bool scull_quantum_shared(struct scull_layout *layout, void *quantum) {
+    bool shared;
+
+    /* nothing shared at all, the common case, needs no lock */
+    if (!atomic_long_read(&layout->nshared)) {
+        return false;
+    }
+    spin_lock(&layout->share_lock);
+    shared = rhashtable_lookup_fast(&layout->shared, &quantum, scull_share_params) != NULL;
+    spin_unlock(&layout->share_lock);
+    return shared;
+}
+
+/* drop an owner of quantum 'i' of 'dptr', freeing it with the last one */
+void scull_put_quantum(struct scull_layout *layout, struct scull_qset *dptr, int i) {
+    struct scull_share *share = NULL;
+
+    if (atomic_long_read(&layout->nshared)) {
+        spin_lock(&layout->share_lock);
+        share = rhashtable_lookup_fast(&layout->shared, &dptr->data[i], scull_share_params);
+        if (share) {
+            atomic_long_dec(&layout->nshared);
+            if (--share->owners) {
+                share = NULL;
+            } else {
+                /* removing an entry never allocates */
+                rhashtable_remove_fast(&layout->shared, &share->node, scull_share_params);
+            }
+            spin_unlock(&layout->share_lock);
+            kfree(share);
+            dptr->data[i] = NULL;
+            return;
+        }
+        spin_unlock(&layout->share_lock);
+    }
+    scull_free_quantum(layout, dptr->data[i]);
+    dptr->data[i] = NULL;
+}
+
+/**
+ * Give quantum 'i' of 'dptr' its own plain copy before it is modified:
+ * shared quanta are copied, compressed ones decompressed.
+ */
+int scull_unshare_quantum(struct scull_layout *layout, struct scull_qset *dptr, int i, gfp_t gfp) {
+    void *copy;
+
+    if (scull_quantum_compressed(dptr->data[i])) {
+        copy = scull_alloc_quantum(layout, gfp);
+        if (copy && scull_decompress_quantum(layout, dptr->data[i], copy)) {
+            scull_free_quantum(layout, copy);
+            copy = NULL;
+        }
+    } else if (scull_quantum_shared(layout, dptr->data[i])) {
+        copy = scull_alloc_quantum(layout, gfp);
+        if (copy) {
+            memcpy(copy, dptr->data[i], layout->quantum);
+        }
+    } else {
+        return 0;
+    }
+    if (!copy) {
+        return -ENOMEM;
+    }
+    scull_put_quantum(layout, dptr, i);
+    dptr->data[i] = copy;
+    return 0;
+}
+
+/* drop a tree's reference to a quantum set, the last one frees it */
+void scull_put_qset(struct scull_layout *layout, struct scull_qset *dptr) {
+    int i;
+
+    if (!refcount_dec_and_test(&dptr->refs)) {
+        return;
+    }
+    if (dptr->data) {
+        for (i = 0; i < layout->qset; i++) {
+            if (dptr->data[i]) {
+                scull_put_quantum(layout, dptr, i);
+            }
+        }
+        scull_free_qarray(layout, dptr->data);
+    }
+    scull_free_qset(dptr);
+    scull_stat_inc(layout->stats, SCULL_STAT_FREES);
+}
+
+/**
+ * Whether 'engine' can serve the given geometry. Item offsets are
+ * computed in an int, so a quantum set must stay below 2GB.
+ */
+bool scull_valid_geometry(const struct scull_engine *engine, int quantum, int qset) {
+    if (quantum <= 0 || qset <= 0 || (long)quantum * qset > INT_MAX) {
+        return false;
+    }
+    if (engine == &scull_page_engine) {
+        return quantum >= PAGE_SIZE && is_power_of_2(quantum) && get_order(quantum) < MAX_ORDER;
+    }
+    return quantum <= KMALLOC_MAX_SIZE;
+}
+
+/**
+ * Build a layout of the given geometry for 'dev': its caches are
+ * shared with every other layout of the same object sizes, its
+ * reserves are not. Its counters are those of the device.
+ */
+struct scull_layout *scull_alloc_layout(struct scull_dev *dev, const struct scull_engine *engine,
+                                        int quantum, int qset) {
+    struct scull_layout *layout = kzalloc(sizeof(*layout), GFP_KERNEL);
+
+    if (!layout) {
+        return NULL;
+    }
+    /* scull_put_layout() destroys it, it comes first */
+    if (rhashtable_init(&layout->shared, &scull_share_params)) {
+        kfree(layout);
+        return NULL;
+    }
+    spin_lock_init(&layout->share_lock);
+    refcount_set(&layout->refs, 1);
+    layout->engine  = engine;
+    layout->quantum = quantum;
+    layout->qset    = qset;
+    layout->stats   = dev->stats;
+    layout->usage   = &dev->usage;
+    layout->placement = &dev->placement;
+
+    layout->qarray_cache = scull_cache_get("scull_qset_", qset * sizeof(char *));
+    if (!layout->qarray_cache) {
+        goto fail;
+    }
+    if (scull_mempool > 0) {
+        layout->qarray_pool = mempool_create_slab_pool(scull_mempool, layout->qarray_cache);
+        if (!layout->qarray_pool) {
+            goto fail;
+        }
+    }
+    if (engine->setup(layout)) {
+        goto fail;
+    }
+    return layout;
+
+fail:
+    scull_put_layout(layout);
+    return NULL;
+}
+
+void scull_get_layout(struct scull_layout *layout) {
+    refcount_inc(&layout->refs);
+}
+
+/* drop a reference, the last one goes once no tree uses the layout */
+void scull_put_layout(struct scull_layout *layout) {
+    if (!refcount_dec_and_test(&layout->refs)) {
+        return;
+    }
+    rhashtable_free_and_destroy(&layout->shared, scull_share_free, NULL);
+    layout->engine->release(layout);
+    mempool_destroy(layout->qarray_pool);
+    scull_cache_put(layout->qarray_cache);
+    kfree(layout);
+}
+
+/**
+ * Drop the quantum sets of items 'first' to 'last' in a tree nobody
+ * else modifies any more; 'layout' is the one it was built with. Sets
+ * still used by a snapshot stay with it.
+ */
+void scull_free_qsets(struct scull_layout *layout, struct xarray *qsets,
+                      unsigned long first, unsigned long last) {
+    struct scull_qset *dptr;
+    unsigned long item = first;
+
+    for (dptr = xa_find(qsets, &item, last, XA_PRESENT); dptr;
+         dptr = xa_find_after(qsets, &item, last, XA_PRESENT)) {
+        scull_put_qset(layout, dptr);
+        cond_resched();
+    }
+}
+
+/**
+ * A detached tree is split into ranges of items, each freed by its own
+ * work item on an unbound workqueue so large devices are torn down by
+ * several CPUs at once. The last range to finish frees the tree and
+ * drops its reference on the layout.
+ */
+#define SCULL_TRIM_CHUNK 1024  /* minimum quantum sets per work item */
+
+struct scull_reaper;
+
+struct scull_reap_chunk {
+    struct work_struct work;
+    struct scull_reaper *reaper;
+    unsigned long first, last;
+};
+
+struct scull_reaper {
+    struct scull_layout *layout;
+    struct xarray *qsets;
+    atomic_t pending;
+    struct scull_reap_chunk chunks[];
+};
+
+static void scull_reap(struct work_struct *work) {
+    struct scull_reap_chunk *chunk = container_of(work, struct scull_reap_chunk, work);
+    struct scull_reaper *reaper = chunk->reaper;
+
+    scull_free_qsets(reaper->layout, reaper->qsets, chunk->first, chunk->last);
+    if (atomic_dec_and_test(&reaper->pending)) {
+        xa_destroy(reaper->qsets);
+        kfree(reaper->qsets);
+        scull_put_layout(reaper->layout);
+        kfree(reaper);
+    }
+}
+
+/**
+ * Hand a detached tree built with 'layout' over to the trim workqueue.
+ * 'nitems' is the number of items the device size covers, used to
+ * split the work; anything beyond it goes to the last range.
+ */
+void scull_free_qsets_async(struct scull_layout *layout, struct xarray *qsets,
+                            unsigned long nitems) {
+    struct scull_reaper *reaper;
+    unsigned long span;
+    int i, nr;
+
+    nr = clamp_t(unsigned long, DIV_ROUND_UP(nitems, SCULL_TRIM_CHUNK), 1, num_online_cpus());
+    span = DIV_ROUND_UP(nitems, nr);
+
+    reaper = kzalloc(struct_size(reaper, chunks, nr), GFP_KERNEL);
+    if (!reaper) {
+        /* free it right here, slow but correct */
+        scull_free_qsets(layout, qsets, 0, ULONG_MAX);
+        xa_destroy(qsets);
+        kfree(qsets);
+        return;
+    }
+    scull_get_layout(layout);
+    reaper->layout = layout;
+    reaper->qsets  = qsets;
+    atomic_set(&reaper->pending, nr);
+
+    for (i = 0; i < nr; i++) {
+        struct scull_reap_chunk *chunk = &reaper->chunks[i];
+
+        INIT_WORK(&chunk->work, scull_reap);
+        chunk->reaper = reaper;
+        chunk->first  = i * span;
+        chunk->last   = (i == nr - 1) ? ULONG_MAX : (i + 1) * span - 1;
+        queue_work(scull_trim_wq, &chunk->work);
+    }
+}
+
+/**
+ * Live reshaping: a work item copies the data into a tree of the new
+ * geometry while readers carry on with the old one. Writers, mmap()
+ * and trim wait on dev->wsem meanwhile, so the copy can't go stale;
+ * the trees are then swapped under the device lock and the old one
+ * goes to the reaper. Holes stay holes.
+ */
+struct scull_reshape {
+    struct work_struct work;
+    struct scull_dev *dev;
+    struct scull_layout *layout;
+};
+
+/* copy 'len' bytes at device offset 'pos' into 'qsets', built with 'layout' */
+static int scull_reshape_fill(struct xarray *qsets, struct scull_layout *layout,
+                              loff_t pos, const void *src, size_t len) {
+    long itemsize = (long)layout->quantum * layout->qset;
+    struct scull_qset *dptr;
+    unsigned long item;
+    int remained, s_pos, q_pos;
+    size_t chunk;
+
+    while (len) {
+        item     = (long)pos / itemsize;
+        remained = (long)pos % itemsize;
+        s_pos    = remained / layout->quantum;
+        q_pos    = remained % layout->quantum;
+
+        /* nobody else sees this tree yet, no locking needed */
+        dptr = xa_load(qsets, item);
+        if (!dptr) {
+            dptr = scull_alloc_qset(layout, GFP_KERNEL);
+            if (!dptr) {
+                return -ENOMEM;
+            }
+            if (xa_err(xa_store(qsets, item, dptr, GFP_KERNEL))) {
+                scull_free_qset(dptr);
+                return -ENOMEM;
+            }
+            scull_stat_inc(layout->stats, SCULL_STAT_ALLOCS);
+        }
+        if (!dptr->data) {
+            dptr->data = scull_alloc_qarray(layout, GFP_KERNEL);
+            if (!dptr->data) {
+                return -ENOMEM;
+            }
+        }
+        if (!dptr->data[s_pos]) {
+            dptr->data[s_pos] = scull_alloc_quantum(layout, GFP_KERNEL);
+            if (!dptr->data[s_pos]) {
+                return -ENOMEM;
+            }
+        }
+
+        chunk = min_t(size_t, len, layout->quantum - q_pos);
+        memcpy(dptr->data[s_pos] + q_pos, src, chunk);
+        pos += chunk;
+        src += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+/* copy every quantum of 'dev' holding data below its size */
+static int scull_reshape_copy(struct scull_dev *dev, struct xarray *qsets,
+                              struct scull_layout *layout) {
+    struct scull_layout *old = dev->layout;
+    long itemsize = (long)old->quantum * old->qset;
+    struct scull_qset *dptr;
+    unsigned long item = 0;
+    void *src, *plain;
+    loff_t pos;
+    int s_pos, retval;
+
+    for (dptr = xa_find(dev->qsets, &item, ULONG_MAX, XA_PRESENT); dptr;
+         dptr = xa_find_after(dev->qsets, &item, ULONG_MAX, XA_PRESENT)) {
+        if (!dptr->data) {
+            continue;
+        }
+        /* writers are out, but the compressor may swap quanta */
+        down_read(&dptr->sem);
+        for (s_pos = 0; s_pos < old->qset; s_pos++) {
+            pos = (loff_t)item * itemsize + (loff_t)s_pos * old->quantum;
+            if (!dptr->data[s_pos] || pos >= dev->size) {
+                continue;
+            }
+            /* the copy is charged too, both trees count until the swap */
+            if (!scull_may_grow(dev)) {
+                up_read(&dptr->sem);
+                return -ENOSPC;
+            }
+            src = plain = NULL;
+            if (scull_quantum_compressed(dptr->data[s_pos])) {
+                src = plain = scull_inflate_quantum(old, dptr->data[s_pos], GFP_KERNEL);
+                if (!plain) {
+                    up_read(&dptr->sem);
+                    return -ENOMEM;
+                }
+            }
+            retval = scull_reshape_fill(qsets, layout, pos, src ?: dptr->data[s_pos],
+                                        min_t(loff_t, old->quantum, dev->size - pos));
+            kvfree(plain);
+            if (retval) {
+                up_read(&dptr->sem);
+                return retval;
+            }
+        }
+        up_read(&dptr->sem);
+        cond_resched();
+    }
+    return 0;
+}
+
+static void scull_reshape_work(struct work_struct *work) {
+    struct scull_reshape *rs = container_of(work, struct scull_reshape, work);
+    struct scull_dev *dev = rs->dev;
+    struct scull_layout *old;
+    struct xarray *qsets;
+    int quantum = rs->layout->quantum, qset = rs->layout->qset;
+    int retval = -ENOMEM;
+
+    qsets = kmalloc(sizeof(*qsets), GFP_KERNEL);
+    if (!qsets) {
+        scull_put_layout(rs->layout);
+        goto out;
+    }
+    xa_init(qsets);
+
+    down_write(&dev->wsem);
+    down_read(&dev->sem);
+    /* mapped before we got here, the pages can't move */
+    if (atomic_read(&dev->vmas)) {
+        retval = -EBUSY;
+    } else {
+        retval = scull_reshape_copy(dev, qsets, rs->layout);
+    }
+    up_read(&dev->sem);
+
+    if (retval) {
+        scull_free_qsets(rs->layout, qsets, 0, ULONG_MAX);
+        xa_destroy(qsets);
+        kfree(qsets);
+        scull_put_layout(rs->layout);
+    } else {
+        down_write(&dev->sem);
+        old = dev->layout;
+        scull_free_qsets_async(old, dev->qsets,
+                               DIV_ROUND_UP(dev->size, (unsigned long)old->quantum * old->qset));
+        dev->qsets  = qsets;
+        dev->layout = rs->layout;
+        scull_put_layout(old);
+        up_write(&dev->sem);
+    }
+    up_write(&dev->wsem);
+
+out:
+    pr_info("reshape to quantum %d, qset %d: %d\n", quantum, qset, retval);
+    WRITE_ONCE(dev->reshape, retval);
+    kfree(rs);
+}
+
+/**
+ * Start re-packing 'dev' into the given geometry. Only one reshape
+ * runs per device; its outcome ends up in dev->reshape.
+ */
+int scull_reshape(struct scull_dev *dev, int quantum, int qset) {
+    struct scull_reshape *rs;
+    int status, retval;
+
+    /* the copy needs all the data in memory */
+    retval = scull_backing_wait(dev);
+    if (retval) {
+        return retval;
+    }
+    rs = kmalloc(sizeof(*rs), GFP_KERNEL);
+    if (!rs) {
+        return -ENOMEM;
+    }
+    if (down_read_killable(&dev->sem)) {
+        kfree(rs);
+        return -ERESTARTSYS;
+    }
+    status = READ_ONCE(dev->reshape);
+    if (!scull_valid_geometry(dev->layout->engine, quantum, qset)) {
+        retval = -EINVAL;
+    } else if (atomic_read(&dev->vmas)) {
+        retval = -EBUSY;
+    } else if (status == 1 || cmpxchg(&dev->reshape, status, 1) != status) {
+        retval = -EBUSY;
+    } else {
+        rs->layout = scull_alloc_layout(dev, dev->layout->engine, quantum, qset);
+        if (!rs->layout) {
+            WRITE_ONCE(dev->reshape, status);
+            retval = -ENOMEM;
+        }
+    }
+    up_read(&dev->sem);
+    if (retval) {
+        kfree(rs);
+        return retval;
+    }
+
+    INIT_WORK(&rs->work, scull_reshape_work);
+    rs->dev = dev;
+    queue_work(scull_trim_wq, &rs->work);
+    return 0;
+}
+
+/* wait for every background trim and reshape */
+void scull_drain_storage(void) {
+    flush_workqueue(scull_trim_wq);
+}
+
+/* quantum size a fresh or trimmed device starts with */
+int scull_default_quantum(void) {
+    if (scull_default_engine == &scull_page_engine) {
+        return PAGE_SIZE << scull_page_order;
+    }
+    return scull_quantum;
+}
+
+/* geometry a fresh or trimmed 'dev' starts with, its own or the defaults */
+int scull_dev_quantum(struct scull_dev *dev) {
+    return dev->quantum ? dev->quantum : scull_default_quantum();
+}
+
+int scull_dev_qset(struct scull_dev *dev) {
+    return dev->qset ? dev->qset : scull_qset;
+}
+
+/* whether new module-wide defaults are usable by the default engine */
+bool scull_valid_defaults(int quantum, int qset) {
+    /* the page engine sizes its quanta with scull_page_order */
+    if (scull_default_engine == &scull_page_engine) {
+        quantum = PAGE_SIZE << scull_page_order;
+    }
+    return scull_valid_geometry(scull_default_engine, quantum, qset);
+}
+
+/**
+ * Give a new device an empty tree and a layout of its geometry, with the caches and optional reserves serving it.
+ */
+int scull_setup_storage(struct scull_dev *dev) {
+    dev->stats = alloc_percpu(struct scull_stats);
+    if (!dev->stats) {
+        return -ENOMEM;
+    }
+    if (scull_shrink_add_dev(dev)) {
+        goto fail_stats;
+    }
+    scull_numa_setup(dev);
+    scull_backing_setup(dev);
+    dev->qsets = kmalloc(sizeof(*dev->qsets), GFP_KERNEL);
+    if (!dev->qsets) {
+        goto fail;
+    }
+    xa_init(dev->qsets);
+
+    dev->layout = scull_alloc_layout(dev, scull_default_engine, scull_dev_quantum(dev),
+                                    scull_dev_qset(dev));
+    if (!dev->layout) {
+        goto fail;
+    }
+    scull_compress_start(dev);
+    scull_dedup_start(dev);
+    return 0;
+
+fail:
+    scull_shrink_del_dev(dev);
+    kfree(dev->qsets);
+    dev->qsets = NULL;
+fail_stats:
+    free_percpu(dev->stats);
+    dev->stats = NULL;
+    return -ENOMEM;
+}
+
+/* the device must be trimmed and its background trim drained */
+void scull_release_storage(struct scull_dev *dev) {
+    scull_backing_release(dev);
+    scull_shrink_del_dev(dev);
+    scull_dedup_stop(dev);
+    scull_compress_stop(dev);
+    scull_put_layout(dev->layout);
+    dev->layout = NULL;
+    xa_destroy(dev->qsets);
+    kfree(dev->qsets);
+    dev->qsets = NULL;
+    free_percpu(dev->stats);
+    dev->stats = NULL;
+}
+
+int scull_storage_init(void) {
+    int ret;
+
+    if (!strcmp(scull_storage, "page")) {
+        scull_default_engine = &scull_page_engine;
+    } else if (strcmp(scull_storage, "slab")) {
+        pr_err("Unknown storage engine '%s'\n", scull_storage);
+        return -EINVAL;
+    }
+    if (scull_page_order < 0 || scull_page_order >= MAX_ORDER) {
+        pr_err("Invalid scull_page_order %d\n", scull_page_order);
+        return -EINVAL;
+    }
+    if (!scull_valid_defaults(scull_quantum, scull_qset)) {
+        pr_err("Invalid geometry, scull_quantum %d, scull_qset %d\n", scull_quantum, scull_qset);
+        return -EINVAL;
+    }
+
+    ret = scull_dedup_init();
+    if (ret) {
+        return ret;
+    }
+    ret = scull_numa_init();
+    if (ret) {
+        return ret;
+    }
+    ret = scull_shrink_init();
+    if (ret) {
+        return ret;
+    }
+    ret = scull_compress_init();
+    if (ret) {
+        scull_shrink_exit();
+        return ret;
+    }
+
+    scull_trim_wq = alloc_workqueue("scull_trim", WQ_UNBOUND, 0);
+    if (!scull_trim_wq) {
+        scull_compress_exit();
+        scull_shrink_exit();
+        return -ENOMEM;
+    }
+    scull_qset_cachep = KMEM_CACHE(scull_qset, 0);
+    if (!scull_qset_cachep) {
+        goto fail;
+    }
+    if (scull_mempool > 0) {
+        scull_qset_pool = mempool_create_slab_pool(scull_mempool, scull_qset_cachep);
+        if (!scull_qset_pool) {
+            goto fail;
+        }
+    }
+    return 0;
+
+fail:
+    kmem_cache_destroy(scull_qset_cachep);
+    destroy_workqueue(scull_trim_wq);
+    scull_compress_exit();
+    scull_shrink_exit();
+    return -ENOMEM;
+}
+
+void scull_storage_exit(void) {
+    destroy_workqueue(scull_trim_wq);
+    mempool_destroy(scull_qset_pool);
+    kmem_cache_destroy(scull_qset_cachep);
+    scull_compress_exit();
+    scull_shrink_exit();
+}
@@ -1,166 +1,700 @@
 #include "scull.h"
+#include <linux/pagemap.h>
+#include <linux/uaccess.h>
 
 int scull_nr_devs = SCULL_NR_DEVS;
+int scull_max_devs = SCULL_MAX_DEVS;
 int scull_quantum = SCULL_QUANTUM;
 int scull_qset    = SCULL_QSET;
 
 /**
- * Allocate memory and link each struct_qest as a list
+ * Look up the quantum set of list item 'item' and allocate it if it
+ * doesn't exist yet. The sets are indexed by item number, so the cost
+ * no longer depends on how far into the device the offset lies.
+ * Concurrent writers may race to create the same item; the first
+ * insertion wins and the others use it.
  */
-struct scull_qset *scull_follow(struct scull_dev *dev, int item) {
-    struct scull_qset *qs_data = dev->data;
-    
+struct scull_qset *scull_follow(struct scull_dev *dev, unsigned long item, gfp_t gfp) {
+    struct scull_qset *qs_data = xa_load(dev->qsets, item);
+    struct scull_qset *old;
+
+    if (qs_data) {
+        return qs_data;
+    }
+
     /* allocate 'scull_qset' structure for 'scull_dev' container */
-    if (!qs_data) {
-        qs_data = kzalloc(sizeof(struct scull_qset), GFP_KERNEL);
-        if (qs_data == NULL) {
-            return NULL; /* Never mind */
-        }
+    qs_data = scull_alloc_qset(dev->layout, gfp);
+    if (qs_data == NULL) {
+        return NULL; /* Never mind */
     }
+    scull_stat_inc(dev->stats, SCULL_STAT_ALLOCS);
 
-    /* continue to allocate memory for qset and link them as a list */
-    while (item--) {
-        if (!qs_data->next) {
-            qs_data->next = kzalloc(sizeof(struct scull_qset), GFP_KERNEL);
-            if (qs_data->next == NULL) {
-                return NULL; /* Never mind */
+    old = xa_cmpxchg(dev->qsets, item, NULL, qs_data, gfp);
+    if (old) {
+        scull_free_qset(qs_data);
+        scull_stat_inc(dev->stats, SCULL_STAT_FREES);
+        return xa_is_err(old) ? NULL : old;
+    }
+
+    return qs_data;
+}
+
+/**
+ * Make the quantum set of 'item' private to the device before it is
+ * modified. 'dptr' is the set found there, locked for writing. A set
+ * still held by a snapshot is replaced by a copy of its pointer array,
+ * its quanta shared until written. Returns the set to use, locked for
+ * writing, or NULL with 'dptr' still locked.
+ */
+struct scull_qset *scull_unshare_qset(struct scull_dev *dev, unsigned long item,
+                                      struct scull_qset *dptr, gfp_t gfp) {
+    struct scull_layout *layout = dev->layout;
+    struct scull_qset *clone;
+    int i;
+
+    if (refcount_read(&dptr->refs) == 1) {
+        return dptr;
+    }
+
+    clone = scull_alloc_qset(layout, gfp);
+    if (!clone) {
+        return NULL;
+    }
+    scull_stat_inc(dev->stats, SCULL_STAT_ALLOCS);
+    if (dptr->data) {
+        clone->data = scull_alloc_qarray(layout, gfp);
+        if (!clone->data) {
+            goto fail;
+        }
+        for (i = 0; i < layout->qset; i++) {
+            if (dptr->data[i]) {
+                if (scull_share_quantum(layout, dptr->data[i], gfp)) {
+                    goto fail;
+                }
+                clone->data[i] = dptr->data[i];
             }
         }
-        qs_data = qs_data->next; /* update list header */
     }
 
-    return qs_data;
+    /* nobody can see the clone yet, but lockdep can't know */
+    down_write_nested(&clone->sem, SINGLE_DEPTH_NESTING);
+    if (xa_is_err(xa_store(dev->qsets, item, clone, gfp))) {
+        up_write(&clone->sem);
+        goto fail;
+    }
+    refcount_dec(&dptr->refs); /* the snapshots keep the old set */
+    up_write(&dptr->sem);
+    return clone;
+
+fail:
+    scull_put_qset(layout, clone);
+    return NULL;
 }
 
 #if 1
 
-ssize_t scull_read (struct file *filp, char __user *buf, size_t count, loff_t *fpos) {
-    struct scull_dev *dev = filp->private_data;
-    struct scull_qset *dptr;
-
-    int quantum  = dev->quantum;
-    int qset     = dev->qset;
-    int itemsize = quantum * qset; /* total bytes */
+/**
+ * Take a scull semaphore for an I/O request. IOCB_NOWAIT callers such
+ * as io_uring get -EAGAIN instead of sleeping on it. A semaphore found
+ * taken counts as a lock wait of 'dev'.
+ */
+static int scull_down_iocb(struct scull_dev *dev, struct rw_semaphore *sem,
+                           struct kiocb *iocb, bool write) {
+    u64 start = scull_hist_start();
+    int retval = 0;
+
+    if (!(write ? down_write_trylock(sem) : down_read_trylock(sem))) {
+        scull_stat_inc(dev->stats, SCULL_STAT_LOCK_WAITS);
+        if (iocb->ki_flags & IOCB_NOWAIT) {
+            retval = -EAGAIN;
+        } else if (write ? down_write_killable(sem) : down_read_killable(sem)) {
+            retval = -ERESTARTSYS;
+        }
+    }
+    scull_hist_end(dev->stats, SCULL_PHASE_LOCK, start);
+    return retval;
+}
 
-    int item, remained, s_pos, q_pos;
-    ssize_t retval = 0;
+/**
+ * Copies to and from user memory run with page faults disabled: the
+ * buffer may be a mapping of this very device, and its fault handler
+ * takes the locks the copy is made under. A short copy drops the
+ * locks, faults the next 'len' bytes of 'iter' in with this helper
+ * and starts over where it stopped. 'dest' says the copy writes into
+ * the buffer. Kernel iterators never fault, short is all they get.
+ */
+static int scull_fault_in(struct iov_iter *iter, size_t len, bool dest) {
+    struct iovec iov;
 
-    if (mutex_lock_interruptible(&dev->mlock)) {
-        return -ERESTARTSYS;
+    if (!iter_is_iovec(iter) || !len) {
+        return -EFAULT;
+    }
+    if (!dest) {
+        return iov_iter_fault_in_readable(iter, len);
     }
+    iov = iov_iter_iovec(iter);
+    return fault_in_pages_writeable(iov.iov_base, min(iov.iov_len, len)) ? -EFAULT : 0;
+}
 
-    /* check bound limitation */
-    if (*fpos >= dev->size) {
-        goto out;
+static size_t scull_copy_to_iter(const void *src, size_t len, struct iov_iter *to) {
+    size_t copied;
+
+    pagefault_disable();
+    copied = src ? copy_to_iter(src, len, to) : iov_iter_zero(len, to);
+    pagefault_enable();
+    return copied;
+}
+
+static size_t scull_copy_from_iter(void *dst, size_t len, struct iov_iter *from) {
+    size_t copied;
+
+    pagefault_disable();
+    copied = copy_from_iter(dst, len, from);
+    pagefault_enable();
+    return copied;
+}
+
+/**
+ * Read 'len' bytes at 'offset' of the hole at quantum number 'n':
+ * zeros, or what the backing file has there while a restore runs.
+ * The device can't be mapped until then, the file is read with faults
+ * on and a short read is an error.
+ */
+static ssize_t scull_read_hole(struct scull_dev *dev, unsigned long n, int offset,
+                               size_t len, struct iov_iter *to, struct kiocb *iocb) {
+    ssize_t ret = -ENOENT;
+
+    if (dev->backing) {
+        ret = scull_backing_read(dev, n, offset, len, to, iocb->ki_flags & IOCB_NOWAIT);
     }
-    if (*fpos + count > dev->size) {
-        count = dev->size - *fpos;
+    if (ret == -ENOENT) {
+        return scull_copy_to_iter(NULL, len, to);
     }
+    return ret >= 0 && ret < len ? -EFAULT : ret;
+}
 
-    /* find listitem, qset index, and offset in the quantum */
-    item     = (long)*fpos / itemsize;
-    remained = (long)*fpos % itemsize;
-    s_pos = remained / quantum; 
-    q_pos = remained % quantum;
+/**
+ * Grow the device to 'end' bytes. Writers to different quantum sets
+ * run concurrently, so the size is only ever raised atomically.
+ */
+void scull_extend_size(struct scull_dev *dev, unsigned long end) {
+    unsigned long size = READ_ONCE(dev->size), prev;
 
-    /* follow the list up to the right position (defined elsewhere) */
-    dptr = scull_follow(dev, item);
+    while (size < end) {
+        prev = cmpxchg(&dev->size, size, end);
+        if (prev == size) {
+            break;
+        }
+        size = prev;
+    }
+}
 
-    if (dptr == NULL || !dptr->data || ! dptr->data[s_pos])
-        goto out; /* don't fill holes */
+/**
+ * Read from 'dev' at iocb->ki_pos. Only the position and the flags of
+ * 'iocb' are used, the block front end passes one without a file.
+ */
+ssize_t scull_dev_read(struct scull_dev *dev, struct kiocb *iocb, struct iov_iter *to) {
+    struct scull_qset *dptr;
 
-    /* read only up to the end of this quantum */
-    if (count > quantum - q_pos) {
-        count = quantum - q_pos;
+    int quantum, qset, itemsize;
+    long item;
+    int remained, s_pos, q_pos;
+    size_t chunk, copied, done = 0;
+    size_t count = iov_iter_count(to);
+    loff_t pos = iocb->ki_pos;
+    unsigned long size;
+    ssize_t retval, ret;
+    void *src, *plain;
+    bool fault;
+    u64 start;
+
+    /* decompressing allocates, nowait requests must not sleep there */
+    gfp_t gfp = (iocb->ki_flags & IOCB_NOWAIT) ?
+                GFP_NOWAIT | __GFP_NOWARN : GFP_KERNEL;
+    int enomem = (iocb->ki_flags & IOCB_NOWAIT) ? -EAGAIN : -ENOMEM;
+
+again:
+    /* shared: only trim and mmap change the structure */
+    retval = scull_down_iocb(dev, &dev->sem, iocb, false);
+    if (retval) {
+        goto out_done;
     }
+    fault = false;
+
+    quantum  = dev->layout->quantum;
+    qset     = dev->layout->qset;
+    itemsize = quantum * qset; /* total bytes */
 
-    if (copy_to_user(buf, dptr->data[s_pos] + q_pos, count)) {
-        retval = -EFAULT;
+    /* check bound limitation, the size may have changed since a fault */
+    size = READ_ONCE(dev->size);
+    if (pos >= size) {
         goto out;
     }
-    *fpos += count;
-    retval = count;
+    if (pos + (count - done) > size) {
+        count = done + size - pos;
+    }
+
+    /* walk every segment of the iterator, one quantum set at a time */
+    while (done < count) {
+        /* find listitem and offset in it */
+        item     = (long)pos / itemsize;
+        remained = (long)pos % itemsize;
+
+        /* look up the quantum set, reading never allocates */
+        dptr = xa_load(dev->qsets, item);
+        if (dptr == NULL) {
+            /* a missing quantum set is a hole, it reads back as zeros */
+            chunk = min_t(size_t, count - done, itemsize - remained);
+            if (dev->backing) {
+                /* unless restoring, then the file is read a quantum at a time */
+                chunk = min_t(size_t, chunk, quantum - remained % quantum);
+            }
+            start = scull_hist_start();
+            ret   = scull_read_hole(dev, item * qset + remained / quantum, remained % quantum,
+                                    chunk, to, iocb);
+            scull_hist_end(dev->stats, SCULL_PHASE_COPY, start);
+            if (ret < 0) {
+                retval = ret;
+                break;
+            }
+            copied = ret;
+
+            /*
+             * A writer publishes the set before it fills a quantum of
+             * it from the file and drops the file's copy, so if the
+             * set is still missing the file was read in time. If not,
+             * read again through the set, under its lock.
+             */
+            if (dev->backing) {
+                smp_rmb();
+                if (xa_load(dev->qsets, item)) {
+                    iov_iter_revert(to, copied);
+                    continue;
+                }
+            }
+
+            pos  += copied;
+            done += copied;
+            if (copied < chunk) {
+                fault = true;
+                break;
+            }
+            continue;
+        }
+
+        retval = scull_down_iocb(dev, &dptr->sem, iocb, false);
+        if (retval) {
+            break;
+        }
+        scull_touch_qset(dptr);
+        while (done < count && remained < itemsize) {
+            s_pos = remained / quantum;
+            q_pos = remained % quantum;
+            src   = dptr->data ? dptr->data[s_pos] : NULL;
+
+            /* cold data stays compressed, read it through a copy */
+            plain = NULL;
+            if (src && scull_quantum_compressed(src)) {
+                src = plain = scull_inflate_quantum(dev->layout, src, gfp);
+                if (!plain) {
+                    retval = enomem;
+                    scull_stat_inc(dev->stats, SCULL_STAT_ENOMEM);
+                    break;
+                }
+            }
+
+            /* read only up to the end of this quantum, holes as zeros */
+            chunk = min_t(size_t, count - done, quantum - q_pos);
+            start = scull_hist_start();
+            if (src) {
+                ret = scull_copy_to_iter(src + q_pos, chunk, to);
+            } else {
+                ret = scull_read_hole(dev, item * qset + s_pos, q_pos, chunk, to, iocb);
+            }
+            scull_hist_end(dev->stats, SCULL_PHASE_COPY, start);
+            kvfree(plain);
+            if (ret < 0) {
+                retval = ret;
+                break;
+            }
+            copied = ret;
+
+            pos      += copied;
+            done     += copied;
+            remained += copied;
+            if (copied < chunk) {
+                fault = true;
+                break;
+            }
+        }
+        up_read(&dptr->sem);
+        if (retval || fault) {
+            break;
+        }
+    }
 
 out:
-    mutex_unlock(&dev->mlock);
+    up_read(&dev->sem);
+    if (fault) {
+        retval = scull_fault_in(to, count - done, true);
+        if (!retval) {
+            goto again;
+        }
+    }
+out_done:
+    /* a short transfer still reports the bytes already moved */
+    if (done) {
+        retval = done;
+        scull_stat_add(dev->stats, SCULL_STAT_READ_BYTES, done);
+    }
+    iocb->ki_pos = pos;
     return retval;
 }
 
-ssize_t scull_write (struct file *filp, const char __user *buf, size_t count, loff_t *fpos) {
-    struct scull_dev *dev = filp->private_data;
-    struct scull_qset *dptr;
-
-    int quantum  = dev->quantum;
-    int qset     = dev->qset;
-    int itemsize = quantum * qset; /* total bytes */
+ssize_t scull_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+    return scull_dev_read(iocb->ki_filp->private_data, iocb, to);
+}
 
-    int item, remained, s_pos, q_pos;
-    ssize_t retval = -ENOMEM;
+/* write to 'dev' at iocb->ki_pos, 'iocb' as for scull_dev_read() */
+ssize_t scull_dev_write(struct scull_dev *dev, struct kiocb *iocb, struct iov_iter *from) {
+    struct scull_qset *dptr, *clone;
+
+    int quantum, qset, itemsize;
+    long item;
+    int remained, s_pos, q_pos;
+    size_t chunk, copied, done = 0;
+    size_t count = iov_iter_count(from);
+    loff_t pos = iocb->ki_pos;
+    ssize_t retval;
+    bool fresh, fault;
+    u64 start;
+
+    /* nowait requests must not sleep in the allocator either */
+    gfp_t gfp = (iocb->ki_flags & IOCB_NOWAIT) ?
+                GFP_NOWAIT | __GFP_NOWARN : GFP_KERNEL;
+    int enomem = (iocb->ki_flags & IOCB_NOWAIT) ? -EAGAIN : -ENOMEM;
+
+again:
+    /* held off while a reshape copies the data */
+    retval = scull_down_iocb(dev, &dev->wsem, iocb, false);
+    if (retval) {
+        goto out_done;
+    }
+    /*
+     * Writers share the device lock too: each one only locks the
+     * quantum sets it touches, so disjoint regions proceed in parallel.
+     */
+    retval = scull_down_iocb(dev, &dev->sem, iocb, false);
+    if (retval) {
+        up_read(&dev->wsem);
+        goto out_done;
+    }
+    fault = false;
+
+    quantum  = dev->layout->quantum;
+    qset     = dev->layout->qset;
+    itemsize = quantum * qset; /* total bytes */
+
+    /* walk every segment of the iterator, one quantum set at a time */
+    while (done < count) {
+        /* find listitem and offset in it */
+        item     = (long)pos / itemsize;
+        remained = (long)pos % itemsize;
+
+        /* follow the list up to the right position */
+        start = scull_hist_start();
+        dptr  = scull_follow(dev, item, gfp);
+        scull_hist_end(dev->stats, SCULL_PHASE_FOLLOW, start);
+        if (dptr == NULL) {
+            retval = enomem;
+            scull_stat_inc(dev->stats, SCULL_STAT_ENOMEM);
+            break;
+        }
 
-    if (mutex_lock_interruptible(&dev->mlock)) {
-        return -ERESTARTSYS;
+        retval = scull_down_iocb(dev, &dptr->sem, iocb, true);
+        if (retval) {
+            break;
+        }
+        /* another writer unshared it meanwhile, look it up again */
+        if (xa_load(dev->qsets, item) != dptr) {
+            up_write(&dptr->sem);
+            continue;
+        }
+        clone = scull_unshare_qset(dev, item, dptr, gfp);
+        if (clone == NULL) {
+            up_write(&dptr->sem);
+            retval = enomem;
+            scull_stat_inc(dev->stats, SCULL_STAT_ENOMEM);
+            break;
+        }
+        dptr = clone;
+        scull_touch_qset(dptr);
+
+        while (done < count && remained < itemsize) {
+            s_pos = remained / quantum;
+            q_pos = remained % quantum;
+
+            if (!dptr->data) {
+                start      = scull_hist_start();
+                dptr->data = scull_alloc_qarray(dev->layout, gfp);
+                scull_hist_end(dev->stats, SCULL_PHASE_ALLOC, start);
+                if (!dptr->data) {
+                    retval = enomem;
+                    scull_stat_inc(dev->stats, SCULL_STAT_ENOMEM);
+                    break;
+                }
+            }
+            fresh = !dptr->data[s_pos];
+            /* a quantum read back from the image counts as a new one */
+            if (fresh && !scull_may_grow(dev)) {
+                retval = -ENOSPC;
+                break;
+            }
+            if (fresh && dev->backing) {
+                /* restoring: the hole may have data in the file */
+                retval = scull_backing_fill(dev, dptr, s_pos, item * qset + s_pos, gfp);
+                if (retval < 0) {
+                    break;
+                }
+                fresh  = !retval;
+                retval = 0;
+            }
+            if (fresh) {
+                start             = scull_hist_start();
+                dptr->data[s_pos] = scull_alloc_quantum(dev->layout, gfp);
+                scull_hist_end(dev->stats, SCULL_PHASE_ALLOC, start);
+                if (!dptr->data[s_pos]) {
+                    retval = enomem;
+                    scull_stat_inc(dev->stats, SCULL_STAT_ENOMEM);
+                    break;
+                }
+            } else if (scull_unshare_quantum(dev->layout, dptr, s_pos, gfp)) {
+                /* shared or compressed, and no memory for a plain copy */
+                retval = enomem;
+                scull_stat_inc(dev->stats, SCULL_STAT_ENOMEM);
+                break;
+            }
+            /* the image no longer has what it holds */
+            scull_backing_dirty(dev, item * qset + s_pos);
+
+            /* write only up to the end of this quantum */
+            chunk  = min_t(size_t, count - done, quantum - q_pos);
+            start  = scull_hist_start();
+            copied = scull_copy_from_iter(dptr->data[s_pos] + q_pos, chunk, from);
+            scull_hist_end(dev->stats, SCULL_PHASE_COPY, start);
+            scull_dedup_zero(dev, dptr, s_pos, q_pos, copied, fresh);
+
+            pos      += copied;
+            done     += copied;
+            remained += copied;
+            if (copied < chunk) {
+                fault = true;
+                break;
+            }
+        }
+        up_write(&dptr->sem);
+        if (retval || fault) {
+            break;
+        }
+    }
+    /* published before the locks go, a trim must see what it frees */
+    if (done) {
+        scull_extend_size(dev, pos);
     }
 
-    /* find listitem, qset index, and offset in the quantum */
-    item     = (long)*fpos / itemsize;
-    remained = (long)*fpos % itemsize;
-    s_pos = remained / quantum; 
-    q_pos = remained % quantum;
+    up_read(&dev->sem);
+    up_read(&dev->wsem);
+    if (fault) {
+        retval = scull_fault_in(from, count - done, false);
+        if (!retval) {
+            goto again;
+        }
+    }
+out_done:
+    /* a short transfer still reports the bytes already moved */
+    if (done) {
+        retval = done;
+        iocb->ki_pos = pos;
+        scull_stat_add(dev->stats, SCULL_STAT_WRITE_BYTES, done);
+    }
+    return retval;
+}
 
-    /* follow the list up to the right position (defined elsewhere) */
-    dptr = scull_follow(dev, item);
+ssize_t scull_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+    return scull_dev_write(iocb->ki_filp->private_data, iocb, from);
+}
 
-    if (dptr == NULL) {
-        goto out;
+/**
+ * Preallocate (mode 0, optionally keeping the size), punch holes in or
+ * zero a range of the device, so producers can take allocation off
+ * their write path. Like writers, this only locks the quantum sets it
+ * touches. Reached through SCULL_IOCFALLOCATE and block discards, so
+ * the arguments get the checks of vfs_fallocate() here.
+ */
+long scull_dev_fallocate(struct scull_dev *dev, int mode, loff_t offset, loff_t len) {
+    struct scull_qset *dptr, *clone;
+    bool punch = mode & FALLOC_FL_PUNCH_HOLE;
+
+    int quantum, qset, itemsize;
+    long item;
+    int remained, s_pos, q_pos;
+    loff_t pos = offset, end = offset + len;
+    size_t chunk;
+    long retval = 0;
+
+    if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) {
+        return -EOPNOTSUPP;
     }
-    if (!dptr->data) {
-        dptr->data = kzalloc(qset * sizeof(char *), GFP_KERNEL);
-        if (!dptr->data) {
-            goto out;
-        }
+    if (punch && (!(mode & FALLOC_FL_KEEP_SIZE) || (mode & FALLOC_FL_ZERO_RANGE))) {
+        return -EOPNOTSUPP;
     }
-    if (!dptr->data[s_pos]) {
-        dptr->data[s_pos] = kmalloc(quantum, GFP_KERNEL);
-        if (!dptr->data[s_pos])
-            goto out;
+    if (offset < 0 || len <= 0) {
+        return -EINVAL;
+    }
+    if (offset > LLONG_MAX - len) {
+        return -EFBIG;
+    }
+    /* holes must be holes, not data still in the backing file */
+    retval = scull_backing_wait(dev);
+    if (retval) {
+        return retval;
     }
 
-    /* read only up to the end of this quantum */
-    if (count > quantum - q_pos) {
-        count = quantum - q_pos;
+    if (down_read_killable(&dev->wsem)) {
+        return -ERESTARTSYS;
+    }
+    if (down_read_killable(&dev->sem)) {
+        up_read(&dev->wsem);
+        return -ERESTARTSYS;
     }
 
-    if (copy_from_user(dptr->data[s_pos] + q_pos, buf, count)) {
-        retval = -EFAULT;
+    /* mapped pages can't be taken away under the mapping */
+    if (punch && atomic_read(&dev->vmas)) {
+        retval = -EBUSY;
         goto out;
     }
-    *fpos += count;
-    retval = count;
 
-    /* update the size */
-    if (dev->size < *fpos) {
-        dev->size = *fpos;
+    quantum  = dev->layout->quantum;
+    qset     = dev->layout->qset;
+    itemsize = quantum * qset; /* total bytes */
+
+    while (pos < end) {
+        /* find listitem and offset in it */
+        item     = (long)pos / itemsize;
+        remained = (long)pos % itemsize;
+
+        /* punching never allocates, a missing set is a hole already */
+        dptr = punch ? xa_load(dev->qsets, item) : scull_follow(dev, item, GFP_KERNEL);
+        if (dptr == NULL) {
+            if (!punch) {
+                retval = -ENOMEM;
+                break;
+            }
+            pos += itemsize - remained;
+            continue;
+        }
+
+        down_write(&dptr->sem);
+        if (xa_load(dev->qsets, item) != dptr) {
+            up_write(&dptr->sem);
+            continue;
+        }
+        clone = scull_unshare_qset(dev, item, dptr, GFP_KERNEL);
+        if (clone == NULL) {
+            up_write(&dptr->sem);
+            retval = -ENOMEM;
+            break;
+        }
+        dptr = clone;
+
+        if (!punch && !dptr->data) {
+            dptr->data = scull_alloc_qarray(dev->layout, GFP_KERNEL);
+            if (!dptr->data) {
+                retval = -ENOMEM;
+            }
+        }
+        while (!retval && pos < end && remained < itemsize) {
+            s_pos = remained / quantum;
+            q_pos = remained % quantum;
+            chunk = min_t(loff_t, end - pos, quantum - q_pos);
+
+            if (punch) {
+                if (dptr->data && dptr->data[s_pos]) {
+                    if (chunk == quantum) {
+                        scull_put_quantum(dev->layout, dptr, s_pos);
+                    } else if (scull_unshare_quantum(dev->layout, dptr, s_pos, GFP_KERNEL)) {
+                        retval = -ENOMEM;
+                        break;
+                    } else {
+                        memset(dptr->data[s_pos] + q_pos, 0, chunk);
+                    }
+                }
+            } else if (!dptr->data[s_pos]) {
+                if (!scull_may_grow(dev)) {
+                    retval = -ENOSPC;
+                    break;
+                }
+                /* fresh quanta come zeroed */
+                dptr->data[s_pos] = scull_alloc_quantum(dev->layout, GFP_KERNEL);
+                if (!dptr->data[s_pos]) {
+                    retval = -ENOMEM;
+                    break;
+                }
+            } else if (mode & FALLOC_FL_ZERO_RANGE) {
+                if (scull_unshare_quantum(dev->layout, dptr, s_pos, GFP_KERNEL)) {
+                    retval = -ENOMEM;
+                    break;
+                }
+                memset(dptr->data[s_pos] + q_pos, 0, chunk);
+            }
+
+            pos      += chunk;
+            remained += chunk;
+        }
+        up_write(&dptr->sem);
+        if (retval) {
+            break;
+        }
+    }
+
+    if (retval == -ENOMEM) {
+        scull_stat_inc(dev->stats, SCULL_STAT_ENOMEM);
+    }
+    if (!retval && !(mode & FALLOC_FL_KEEP_SIZE)) {
+        scull_extend_size(dev, end);
     }
 
 out:
-    mutex_unlock(&dev->mlock);
+    up_read(&dev->sem);
+    up_read(&dev->wsem);
     return retval;
 }
 
-
 int scull_open (struct inode *inode, struct file *filp) {
     struct scull_dev *dev; /* device information */
 
-    dev = container_of(inode->i_cdev, struct scull_dev, cdev);
+    /* the device may have been removed since the node was looked up */
+    dev = scull_get_dev(iminor(inode));
+    if (!dev) {
+        return -ENODEV;
+    }
     filp->private_data = dev; /* acquire information */
+    filp->f_mode |= FMODE_NOWAIT; /* read_iter/write_iter honor IOCB_NOWAIT */
 
     /* now trim to 0 the length of the device if open was write-only */
     if ((filp->f_flags & O_ACCMODE) == O_WRONLY) {
-        if (mutex_lock_interruptible(&dev->mlock)) {
+        if (down_read_killable(&dev->wsem)) {
+            scull_put_dev(dev);
+            return -ERESTARTSYS;
+        }
+        if (down_write_killable(&dev->sem)) {
+            up_read(&dev->wsem);
+            scull_put_dev(dev);
             return -ERESTARTSYS;
         }
         scull_trim(dev); /* ignore errors */
-        mutex_unlock(&dev->mlock);
+        up_write(&dev->sem);
+        up_read(&dev->wsem);
     }
 
     return 0;
@@ -169,39 +703,114 @@ int scull_open (struct inode *inode, struct file *filp) {
 
 int scull_release (struct inode *inode, struct file *filp) {
     pr_notice("scull_release minor:%u\n", MINOR(inode->i_rdev));
+    scull_put_dev(filp->private_data);
 
     return 0;
 }
 
 /**
  * Empty out the scull device; must be called with 
- * the device semaphore held.
+ * the device semaphore held. A mapped device can't be trimmed.
+ * The quantum sets are detached in O(1) and freed in the background,
+ * so the cost doesn't depend on the device size. The device then
+ * takes up the geometry it was created with, or the default one,
+ * which ioctl() may have changed.
  */
 int scull_trim(struct scull_dev *dev) {
-    int i;
-    struct scull_qset *next = NULL;
-    struct scull_qset *dptr = NULL;
-    int qset = dev->qset;
+    struct scull_layout *layout = dev->layout;
+    struct xarray *fresh;
+    unsigned long nitems;
+    int quantum, qset;
 
-    for (dptr = dev->data; dptr; dptr = next) {
-        if (dptr->data) {
-            for (i = 0; i < qset; i++) {
-                kfree(dptr->data[i]);
-            }
-            kfree(dptr->data);
-            dptr->data = NULL;
+    if (atomic_read(&dev->vmas)) {
+        return -EBUSY;
+    }
+    scull_stat_inc(dev->stats, SCULL_STAT_TRIMS);
+    scull_backing_drop(dev);
+
+    if (!xa_empty(dev->qsets)) {
+        nitems = DIV_ROUND_UP(dev->size, (unsigned long)layout->quantum * layout->qset);
+        fresh  = kmalloc(sizeof(*fresh), GFP_KERNEL);
+        if (fresh) {
+            xa_init(fresh);
+            scull_free_qsets_async(layout, dev->qsets, nitems);
+            dev->qsets = fresh;
+        } else {
+            /* no memory for a new tree, empty the old one in place */
+            scull_free_qsets(layout, dev->qsets, 0, ULONG_MAX);
+            xa_destroy(dev->qsets);
+        }
+    }
+    /*
+     * The defaults are read without their lock, an ioctl() changing them
+     * meanwhile may leave a pair that never was: check it again.
+     */
+    quantum = scull_dev_quantum(dev);
+    qset    = scull_dev_qset(dev);
+    if ((layout->quantum != quantum || layout->qset != qset) &&
+        scull_valid_geometry(scull_default_engine, quantum, qset)) {
+        /* keep the old geometry if the new one can't be set up */
+        layout = scull_alloc_layout(dev, scull_default_engine, quantum, qset);
+        if (layout) {
+            scull_put_layout(dev->layout);
+            dev->layout = layout;
         }
-        next = dptr->next;
-        kfree(dptr);
     }
-    dev->qset    = scull_qset;
-    dev->quantum = scull_quantum;
-    dev->size    = 0;
-    dev->data    = NULL;
+    dev->size = 0;
 
     return 0;
 }
 
+/**
+ * Find the first offset at or after 'pos' that holds data ('data' set)
+ * or lies in a hole, at quantum granularity. The end of the device
+ * counts as a hole; there is no data past it. Missing quantum sets
+ * are skipped with a single xarray search.
+ */
+static loff_t scull_seek_data(struct scull_dev *dev, loff_t pos, bool data) {
+    struct scull_qset *dptr;
+    unsigned long size = dev->size;
+    int quantum = dev->layout->quantum, qset = dev->layout->qset;
+    long itemsize = (long)quantum * qset;
+    unsigned long item, found;
+    bool present;
+    int s_pos;
+
+    if (pos < 0 || pos >= size) {
+        return -ENXIO;
+    }
+
+    while (pos < size) {
+        item  = pos / itemsize;
+        found = item;
+        dptr  = xa_find(dev->qsets, &found, ULONG_MAX, XA_PRESENT);
+        if (dptr == NULL || found != item) {
+            /* no quantum set here: a hole up to the next one */
+            if (!data) {
+                return pos;
+            }
+            if (dptr == NULL) {
+                break;
+            }
+            pos = (loff_t)found * itemsize;
+            continue;
+        }
+
+        down_read(&dptr->sem);
+        for (s_pos = (pos % itemsize) / quantum; s_pos < qset && pos < size; s_pos++) {
+            present = dptr->data && dptr->data[s_pos];
+            if (present == data) {
+                up_read(&dptr->sem);
+                return pos;
+            }
+            pos = (loff_t)item * itemsize + (loff_t)(s_pos + 1) * quantum;
+        }
+        up_read(&dptr->sem);
+    }
+
+    return data ? -ENXIO : size;
+}
+
 loff_t scull_llseek(struct file *filp, loff_t offset, int whence)
 {
     struct scull_dev *dev = filp->private_data;
@@ -217,6 +826,21 @@ loff_t scull_llseek(struct file *filp, loff_t offset, int whence)
         case 2: /* SEEK_END */
             newpos = dev->size + offset;
             break;
+        case SEEK_DATA:
+        case SEEK_HOLE:
+            newpos = scull_backing_wait(dev);
+            if (newpos) {
+                return newpos;
+            }
+            if (down_read_killable(&dev->sem)) {
+                return -ERESTARTSYS;
+            }
+            newpos = scull_seek_data(dev, offset, whence == SEEK_DATA);
+            up_read(&dev->sem);
+            if (newpos < 0) {
+                return newpos;
+            }
+            break;
         default: /* can't happen */
             return -EINVAL;
     }
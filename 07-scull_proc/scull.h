@@ -8,6 +8,7 @@
 #include <linux/slab.h>
 #include <asm/uaccess.h>
 #include <linux/mutex.h>
+#include <linux/xarray.h>
 #include <linux/moduleparam.h>
 
 /* format the print function */
@@ -33,11 +34,10 @@
 
 struct scull_qset {
     void **data;
-    struct scull_qset *next;
 };
 
 struct scull_dev {
-    struct scull_qset *data;    /* Pointer to first quantum set */
+    struct xarray qsets;        /* quantum sets indexed by list item */
     int quantum;                /* the current quantum size */
     int qset;                   /* the current qset size */
     unsigned long size;         /* amount of data stored here */
@@ -52,6 +52,7 @@ ssize_t scull_write (struct file *filp, const char __user *buf, size_t count, lo
 int scull_open (struct inode *inode, struct file *filp);
 int scull_release (struct inode *inode, struct file *filp);
 int scull_trim(struct scull_dev *dev);
+struct scull_qset *scull_follow(struct scull_dev *dev, unsigned long item);
 
 extern int scull_nr_devs;
 extern int scull_quantum;
@@ -56,6 +56,7 @@ static void * scull_seq_next (struct seq_file *m, void *v, loff_t *pos) {
 static int scull_seq_show (struct seq_file *m, void *v) {
     struct scull_dev *dev = (struct scull_dev *) v;
     struct scull_qset *d;
+    unsigned long item;
     int i;
 
     if (mutex_lock_interruptible(&dev->mlock)) {
@@ -65,10 +66,10 @@ static int scull_seq_show (struct seq_file *m, void *v) {
     seq_printf(m, "Device %i: qset %i, q %i, sz %li\n", 
         (int)(dev - scull_devs), dev->qset, dev->quantum, dev->size);
 
-    for (d = dev->data; d; d = d->next) {
+    xa_for_each(&dev->qsets, item, d) {
         /* print the addresses of qset item and start qset */
-        seq_printf(m, " item at %p, qset at %p\n", d, d->data);
-        if (d->data && !d->next) { /* scan the list */
+        seq_printf(m, " item %lu at %p, qset at %p\n", item, d, d->data);
+        if (d->data) { /* scan the quantum set */
             for (i = 0; i < dev->qset; i++) {
                 if (d->data[i]) {
                     seq_printf(m, "    % 4i: %8p\n", i, d->data[i]);
@@ -146,7 +147,7 @@ static int __init scull_init(void) {
         scull_devs[i].quantum    = scull_quantum;
         scull_devs[i].qset       = scull_qset;
         scull_devs[i].size       = 0;
-        scull_devs[i].data       = NULL;
+        xa_init(&scull_devs[i].qsets);
         mutex_init(&scull_devs[i].mlock);
         ret = cdev_add(&scull_devs[i].cdev, 
                         MKDEV(MAJOR(scull_dev_num), MINOR(scull_dev_num) + i), /* base responsible device number */
@@ -5,28 +5,25 @@ int scull_quantum = SCULL_QUANTUM;
 int scull_qset    = SCULL_QSET;
 
 /**
- * Allocate memory and link each struct_qest as a list
+ * Look up the quantum set of list item 'item' and allocate it if it
+ * doesn't exist yet. The sets are indexed by item number, so the cost
+ * no longer depends on how far into the device the offset lies.
  */
-struct scull_qset *scull_follow(struct scull_dev *dev, int item) {
-    struct scull_qset *qs_data = dev->data;
-    
-    /* allocate 'scull_qset' structure for 'scull_dev' container */
-    if (!qs_data) {
-        qs_data = kzalloc(sizeof(struct scull_qset), GFP_KERNEL);
-        if (qs_data == NULL) {
-            return NULL; /* Never mind */
-        }
+struct scull_qset *scull_follow(struct scull_dev *dev, unsigned long item) {
+    struct scull_qset *qs_data = xa_load(&dev->qsets, item);
+
+    if (qs_data) {
+        return qs_data;
     }
 
-    /* continue to allocate memory for qset and link them as a list */
-    while (item--) {
-        if (!qs_data->next) {
-            qs_data->next = kzalloc(sizeof(struct scull_qset), GFP_KERNEL);
-            if (qs_data->next == NULL) {
-                return NULL; /* Never mind */
-            }
-        }
-        qs_data = qs_data->next; /* update list header */
+    /* allocate 'scull_qset' structure for 'scull_dev' container */
+    qs_data = kzalloc(sizeof(struct scull_qset), GFP_KERNEL);
+    if (qs_data == NULL) {
+        return NULL; /* Never mind */
+    }
+    if (xa_err(xa_store(&dev->qsets, item, qs_data, GFP_KERNEL))) {
+        kfree(qs_data);
+        return NULL;
     }
 
     return qs_data;
@@ -42,7 +39,9 @@ ssize_t scull_read (struct file *filp, char __user *buf, size_t count, loff_t *f
     int qset     = dev->qset;
     int itemsize = quantum * qset; /* total bytes */
 
-    int item, remained, qblock, qoffset;
+    long item;
+    int remained, qblock, qoffset;
+    size_t chunk, done = 0;
     ssize_t retval = 0;
 
     pr_info("is invoked\n");
@@ -51,41 +50,42 @@ ssize_t scull_read (struct file *filp, char __user *buf, size_t count, loff_t *f
         return -ERESTARTSYS;
     }
 
-    /* check bound limitation */
+    /* check bound limitation, nothing is left past the end */
     if (*fpos >= dev->size) {
-        goto out;
-    }
-    if (*fpos + count > dev->size) {
+        count = 0;
+    } else if (*fpos + count > dev->size) {
         count = dev->size - *fpos;
     }
 
-    /* find listitem, qset index, and offset in the quantum */
-    item     = (long)*fpos / itemsize;
-    remained = (long)*fpos % itemsize;
-    qblock = remained / quantum; 
-    qoffset = remained % quantum;
+    /* move the whole request, crossing quantum and qset boundaries */
+    while (done < count) {
+        /* find listitem, qset index, and offset in the quantum */
+        item     = (long)*fpos / itemsize;
+        remained = (long)*fpos % itemsize;
+        qblock = remained / quantum;
+        qoffset = remained % quantum;
 
-    /* follow the list up to the right position (defined elsewhere) */
-    dptr = scull_follow(dev, item);
+        /* look up the quantum set, reading never allocates */
+        dptr = xa_load(&dev->qsets, item);
 
-    if (dptr == NULL || !dptr->data || ! dptr->data[qblock])
-        goto out; /* don't fill holes */
+        if (dptr == NULL || !dptr->data || !dptr->data[qblock])
+            break; /* don't fill holes */
 
-    /* read only up to the end of this quantum */
-    if (count > quantum - qoffset) {
-        count = quantum - qoffset;
-    }
+        /* read only up to the end of this quantum */
+        chunk = min_t(size_t, count - done, quantum - qoffset);
 
-    if (copy_to_user(buf, dptr->data[qblock] + qoffset, count)) {
-        retval = -EFAULT;
-        goto out;
+        if (copy_to_user(buf + done, dptr->data[qblock] + qoffset, chunk)) {
+            retval = -EFAULT;
+            break;
+        }
+        *fpos += chunk;
+        done  += chunk;
+    }
+    if (done) {
+        retval = done;
     }
-    *fpos += count;
-    retval = count;
 
-out:
-    pr_info("RD pos = %lld, block = %d, offset = %d, read %lu bytes\n",
-            *fpos, qblock, qoffset, count);
+    pr_info("RD pos = %lld, read %zu bytes\n", *fpos, done);
     mutex_unlock(&dev->mlock);
     return retval;
 }
@@ -98,8 +98,10 @@ ssize_t scull_write (struct file *filp, const char __user *buf, size_t count, lo
     int qset     = dev->qset;
     int itemsize = quantum * qset; /* total bytes */
 
-    int item, remained, qblock, qoffset;
-    ssize_t retval = -ENOMEM;
+    long item;
+    int remained, qblock, qoffset;
+    size_t chunk, done = 0;
+    ssize_t retval = 0;
 
     pr_info("is invoked\n");
 
@@ -107,50 +109,58 @@ ssize_t scull_write (struct file *filp, const char __user *buf, size_t count, lo
         return -ERESTARTSYS;
     }
 
-    /* find listitem, qset index, and offset in the quantum */
-    item     = (long)*fpos / itemsize;
-    remained = (long)*fpos % itemsize;
-    qblock = remained / quantum; 
-    qoffset = remained % quantum;
+    /* move the whole request, crossing quantum and qset boundaries */
+    while (done < count) {
+        /* find listitem, qset index, and offset in the quantum */
+        item     = (long)*fpos / itemsize;
+        remained = (long)*fpos % itemsize;
+        qblock = remained / quantum;
+        qoffset = remained % quantum;
 
-    /* follow the list up to the right position (defined elsewhere) */
-    dptr = scull_follow(dev, item);
+        /* follow the list up to the right position */
+        dptr = scull_follow(dev, item);
 
-    if (dptr == NULL) {
-        goto out;
-    }
-    if (!dptr->data) {
-        dptr->data = kzalloc(qset * sizeof(char *), GFP_KERNEL);
+        if (dptr == NULL) {
+            retval = -ENOMEM;
+            break;
+        }
         if (!dptr->data) {
-            goto out;
+            dptr->data = kzalloc(qset * sizeof(char *), GFP_KERNEL);
+            if (!dptr->data) {
+                retval = -ENOMEM;
+                break;
+            }
+        }
+        if (!dptr->data[qblock]) {
+            dptr->data[qblock] = kmalloc(quantum, GFP_KERNEL);
+            if (!dptr->data[qblock]) {
+                retval = -ENOMEM;
+                break;
+            }
         }
-    }
-    if (!dptr->data[qblock]) {
-        dptr->data[qblock] = kmalloc(quantum, GFP_KERNEL);
-        if (!dptr->data[qblock])
-            goto out;
-    }
 
-    /* read only up to the end of this quantum */
-    if (count > quantum - qoffset) {
-        count = quantum - qoffset;
-    }
+        /* write only up to the end of this quantum */
+        chunk = min_t(size_t, count - done, quantum - qoffset);
 
-    if (copy_from_user(dptr->data[qblock] + qoffset, buf, count)) {
-        retval = -EFAULT;
-        goto out;
+        if (copy_from_user(dptr->data[qblock] + qoffset, buf + done, chunk)) {
+            retval = -EFAULT;
+            break;
+        }
+        *fpos += chunk;
+        done  += chunk;
     }
-    *fpos += count;
-    retval = count;
 
-    /* update the size */
-    if (dev->size < *fpos) {
-        dev->size = *fpos;
+    /* a short transfer still reports the bytes already moved */
+    if (done) {
+        retval = done;
+
+        /* update the size */
+        if (dev->size < *fpos) {
+            dev->size = *fpos;
+        }
     }
 
-out:
-    pr_info("WR pos = %lld, block = %d, offset = %d, read %lu bytes\n",
-            *fpos, qblock, qoffset, count);
+    pr_info("WR pos = %lld, written %zu bytes\n", *fpos, done);
     mutex_unlock(&dev->mlock);
     return retval;
 }
@@ -189,11 +199,11 @@ int scull_release (struct inode *inode, struct file *filp) {
  */
 int scull_trim(struct scull_dev *dev) {
     int i;
-    struct scull_qset *next = NULL;
+    unsigned long item;
     struct scull_qset *dptr = NULL;
     int qset = dev->qset;
 
-    for (dptr = dev->data; dptr; dptr = next) {
+    xa_for_each(&dev->qsets, item, dptr) {
         if (dptr->data) {
             for (i = 0; i < qset; i++) {
                 kfree(dptr->data[i]);
@@ -201,13 +211,12 @@ int scull_trim(struct scull_dev *dev) {
             kfree(dptr->data);
             dptr->data = NULL;
         }
-        next = dptr->next;
         kfree(dptr);
     }
+    xa_destroy(&dev->qsets);
     dev->qset    = scull_qset;
     dev->quantum = scull_quantum;
     dev->size    = 0;
-    dev->data    = NULL;
 
     return 0;
 }
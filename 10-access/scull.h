@@ -8,6 +8,7 @@
 #include <linux/slab.h>
 #include <asm/uaccess.h>
 #include <linux/mutex.h>
+#include <linux/xarray.h>
 #include <linux/moduleparam.h>
 #include <linux/ioctl.h> /* needed for the _IOW etc stuff used later */
 
@@ -30,11 +31,10 @@
 
 struct scull_qset {
     void **data;
-    struct scull_qset *next;
 };
 
 struct scull_dev {
-    struct scull_qset *data;    /* Pointer to first quantum set */
+    struct xarray qsets;        /* quantum sets indexed by list item */
     int quantum;                /* the current quantum size */
     int qset;                   /* the current qset size */
     unsigned long size;         /* amount of data stored here */
@@ -49,7 +49,9 @@ ssize_t scull_write (struct file *filp, const char __user *buf, size_t count, lo
 int scull_open (struct inode *inode, struct file *filp);
 int scull_release (struct inode *inode, struct file *filp);
 loff_t scull_llseek(struct file *filp, loff_t offset, int whence);
+long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
 int scull_trim(struct scull_dev *dev);
+struct scull_qset *scull_follow(struct scull_dev *dev, unsigned long item);
 
 extern int scull_nr_devs;
 extern int scull_quantum;
@@ -37,6 +37,8 @@ struct file_operations scull_single_fops = {
     .llseek =     	scull_llseek,
     .read =       	scull_read,
     .write =      	scull_write,
+    .unlocked_ioctl =	scull_ioctl,
+    .compat_ioctl =	compat_ptr_ioctl,
     .open =       	scull_s_open,
     .release =    	scull_s_release,
 };
@@ -90,6 +92,8 @@ struct file_operations scull_user_fops = {
     .llseek =     scull_llseek,
     .read =       scull_read,
     .write =      scull_write,
+    .unlocked_ioctl = scull_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
     .open =       scull_u_open,
     .release =    scull_u_release,
 };
@@ -164,6 +168,8 @@ struct file_operations scull_wusr_fops = {
     .llseek =     scull_llseek,
     .read =       scull_read,
     .write =      scull_write,
+    .unlocked_ioctl = scull_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
     .open =       scull_w_open,
     .release =    scull_w_release,
 };
@@ -10,12 +10,14 @@ static dev_t scull_dev_num;
 static struct scull_dev *scull_devs;
 
 static const struct file_operations scull_fops = {
-    .owner   = THIS_MODULE,
-    .read    = scull_read,
-    .write   = scull_write,
-    .open    = scull_open,
-    .llseek  = scull_llseek,
-    .release = scull_release,
+    .owner          = THIS_MODULE,
+    .read           = scull_read,
+    .write          = scull_write,
+    .open           = scull_open,
+    .llseek         = scull_llseek,
+    .unlocked_ioctl = scull_ioctl,
+    .compat_ioctl   = compat_ptr_ioctl,
+    .release        = scull_release,
 };
 
 
@@ -51,7 +53,7 @@ static int __init scull_init(void) {
         scull_devs[i].quantum    = scull_quantum;
         scull_devs[i].qset       = scull_qset;
         scull_devs[i].size       = 0;
-        scull_devs[i].data       = NULL;
+        xa_init(&scull_devs[i].qsets);
         mutex_init(&scull_devs[i].mlock);
         ret = cdev_add(&scull_devs[i].cdev, 
                         MKDEV(MAJOR(scull_dev_num), MINOR(scull_dev_num) + i), /* base responsible device number */
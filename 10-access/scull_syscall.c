@@ -4,29 +4,29 @@ int scull_nr_devs = SCULL_NR_DEVS;
 int scull_quantum = SCULL_QUANTUM;
 int scull_qset    = SCULL_QSET;
 
+/* the default quantum and qset are read and changed as a pair */
+static DEFINE_MUTEX(scull_defaults_lock);
+
 /**
- * Allocate memory and link each struct_qest as a list
+ * Look up the quantum set of list item 'item' and allocate it if it
+ * doesn't exist yet. The sets are indexed by item number, so the cost
+ * no longer depends on how far into the device the offset lies.
  */
-struct scull_qset *scull_follow(struct scull_dev *dev, int item) {
-    struct scull_qset *qs_data = dev->data;
-    
-    /* allocate 'scull_qset' structure for 'scull_dev' container */
-    if (!qs_data) {
-        qs_data = kzalloc(sizeof(struct scull_qset), GFP_KERNEL);
-        if (qs_data == NULL) {
-            return NULL; /* Never mind */
-        }
+struct scull_qset *scull_follow(struct scull_dev *dev, unsigned long item) {
+    struct scull_qset *qs_data = xa_load(&dev->qsets, item);
+
+    if (qs_data) {
+        return qs_data;
     }
 
-    /* continue to allocate memory for qset and link them as a list */
-    while (item--) {
-        if (!qs_data->next) {
-            qs_data->next = kzalloc(sizeof(struct scull_qset), GFP_KERNEL);
-            if (qs_data->next == NULL) {
-                return NULL; /* Never mind */
-            }
-        }
-        qs_data = qs_data->next; /* update list header */
+    /* allocate 'scull_qset' structure for 'scull_dev' container */
+    qs_data = kzalloc(sizeof(struct scull_qset), GFP_KERNEL);
+    if (qs_data == NULL) {
+        return NULL; /* Never mind */
+    }
+    if (xa_err(xa_store(&dev->qsets, item, qs_data, GFP_KERNEL))) {
+        kfree(qs_data);
+        return NULL;
     }
 
     return qs_data;
@@ -42,46 +42,50 @@ ssize_t scull_read (struct file *filp, char __user *buf, size_t count, loff_t *f
     int qset     = dev->qset;
     int itemsize = quantum * qset; /* total bytes */
 
-    int item, remained, s_pos, q_pos;
+    long item;
+    int remained, s_pos, q_pos;
+    size_t chunk, done = 0;
     ssize_t retval = 0;
 
     if (mutex_lock_interruptible(&dev->mlock)) {
         return -ERESTARTSYS;
     }
 
-    /* check bound limitation */
+    /* check bound limitation, nothing is left past the end */
     if (*fpos >= dev->size) {
-        goto out;
-    }
-    if (*fpos + count > dev->size) {
+        count = 0;
+    } else if (*fpos + count > dev->size) {
         count = dev->size - *fpos;
     }
 
-    /* find listitem, qset index, and offset in the quantum */
-    item     = (long)*fpos / itemsize;
-    remained = (long)*fpos % itemsize;
-    s_pos = remained / quantum; 
-    q_pos = remained % quantum;
+    /* move the whole request, crossing quantum and qset boundaries */
+    while (done < count) {
+        /* find listitem, qset index, and offset in the quantum */
+        item     = (long)*fpos / itemsize;
+        remained = (long)*fpos % itemsize;
+        s_pos = remained / quantum;
+        q_pos = remained % quantum;
 
-    /* follow the list up to the right position (defined elsewhere) */
-    dptr = scull_follow(dev, item);
+        /* look up the quantum set, reading never allocates */
+        dptr = xa_load(&dev->qsets, item);
 
-    if (dptr == NULL || !dptr->data || ! dptr->data[s_pos])
-        goto out; /* don't fill holes */
+        if (dptr == NULL || !dptr->data || !dptr->data[s_pos])
+            break; /* don't fill holes */
 
-    /* read only up to the end of this quantum */
-    if (count > quantum - q_pos) {
-        count = quantum - q_pos;
-    }
+        /* read only up to the end of this quantum */
+        chunk = min_t(size_t, count - done, quantum - q_pos);
 
-    if (copy_to_user(buf, dptr->data[s_pos] + q_pos, count)) {
-        retval = -EFAULT;
-        goto out;
+        if (copy_to_user(buf + done, dptr->data[s_pos] + q_pos, chunk)) {
+            retval = -EFAULT;
+            break;
+        }
+        *fpos += chunk;
+        done  += chunk;
+    }
+    if (done) {
+        retval = done;
     }
-    *fpos += count;
-    retval = count;
 
-out:
     mutex_unlock(&dev->mlock);
     return retval;
 }
@@ -94,55 +98,66 @@ ssize_t scull_write (struct file *filp, const char __user *buf, size_t count, lo
     int qset     = dev->qset;
     int itemsize = quantum * qset; /* total bytes */
 
-    int item, remained, s_pos, q_pos;
-    ssize_t retval = -ENOMEM;
+    long item;
+    int remained, s_pos, q_pos;
+    size_t chunk, done = 0;
+    ssize_t retval = 0;
 
     if (mutex_lock_interruptible(&dev->mlock)) {
         return -ERESTARTSYS;
     }
 
-    /* find listitem, qset index, and offset in the quantum */
-    item     = (long)*fpos / itemsize;
-    remained = (long)*fpos % itemsize;
-    s_pos = remained / quantum; 
-    q_pos = remained % quantum;
+    /* move the whole request, crossing quantum and qset boundaries */
+    while (done < count) {
+        /* find listitem, qset index, and offset in the quantum */
+        item     = (long)*fpos / itemsize;
+        remained = (long)*fpos % itemsize;
+        s_pos = remained / quantum;
+        q_pos = remained % quantum;
 
-    /* follow the list up to the right position (defined elsewhere) */
-    dptr = scull_follow(dev, item);
+        /* follow the list up to the right position */
+        dptr = scull_follow(dev, item);
 
-    if (dptr == NULL) {
-        goto out;
-    }
-    if (!dptr->data) {
-        dptr->data = kzalloc(qset * sizeof(char *), GFP_KERNEL);
+        if (dptr == NULL) {
+            retval = -ENOMEM;
+            break;
+        }
         if (!dptr->data) {
-            goto out;
+            dptr->data = kzalloc(qset * sizeof(char *), GFP_KERNEL);
+            if (!dptr->data) {
+                retval = -ENOMEM;
+                break;
+            }
+        }
+        if (!dptr->data[s_pos]) {
+            dptr->data[s_pos] = kmalloc(quantum, GFP_KERNEL);
+            if (!dptr->data[s_pos]) {
+                retval = -ENOMEM;
+                break;
+            }
         }
-    }
-    if (!dptr->data[s_pos]) {
-        dptr->data[s_pos] = kmalloc(quantum, GFP_KERNEL);
-        if (!dptr->data[s_pos])
-            goto out;
-    }
 
-    /* read only up to the end of this quantum */
-    if (count > quantum - q_pos) {
-        count = quantum - q_pos;
-    }
+        /* write only up to the end of this quantum */
+        chunk = min_t(size_t, count - done, quantum - q_pos);
 
-    if (copy_from_user(dptr->data[s_pos] + q_pos, buf, count)) {
-        retval = -EFAULT;
-        goto out;
+        if (copy_from_user(dptr->data[s_pos] + q_pos, buf + done, chunk)) {
+            retval = -EFAULT;
+            break;
+        }
+        *fpos += chunk;
+        done  += chunk;
     }
-    *fpos += count;
-    retval = count;
 
-    /* update the size */
-    if (dev->size < *fpos) {
-        dev->size = *fpos;
+    /* a short transfer still reports the bytes already moved */
+    if (done) {
+        retval = done;
+
+        /* update the size */
+        if (dev->size < *fpos) {
+            dev->size = *fpos;
+        }
     }
 
-out:
     mutex_unlock(&dev->mlock);
     return retval;
 }
@@ -179,11 +194,11 @@ int scull_release (struct inode *inode, struct file *filp) {
  */
 int scull_trim(struct scull_dev *dev) {
     int i;
-    struct scull_qset *next = NULL;
+    unsigned long item;
     struct scull_qset *dptr = NULL;
     int qset = dev->qset;
 
-    for (dptr = dev->data; dptr; dptr = next) {
+    xa_for_each(&dev->qsets, item, dptr) {
         if (dptr->data) {
             for (i = 0; i < qset; i++) {
                 kfree(dptr->data[i]);
@@ -191,13 +206,14 @@ int scull_trim(struct scull_dev *dev) {
             kfree(dptr->data);
             dptr->data = NULL;
         }
-        next = dptr->next;
         kfree(dptr);
     }
+    xa_destroy(&dev->qsets);
+    mutex_lock(&scull_defaults_lock);
     dev->qset    = scull_qset;
     dev->quantum = scull_quantum;
+    mutex_unlock(&scull_defaults_lock);
     dev->size    = 0;
-    dev->data    = NULL;
 
     return 0;
 }
@@ -224,4 +240,138 @@ loff_t scull_llseek(struct file *filp, loff_t offset, int whence)
     filp->f_pos = newpos;
     
     return newpos;
-}
\ No newline at end of file
+}
+
+/**
+ * The ioctl() implementation. The quantum and qset commands act on the
+ * module-wide defaults, which each device picks up at its next trim.
+ */
+
+/**
+ * Install 'val' as the default quantum ('quantum' set) or qset, the
+ * previous value goes to 'old' if not NULL. The pair is checked and
+ * updated under a mutex, so two callers changing one each can't leave
+ * an invalid pair behind. A quantum set must stay addressable with an
+ * int offset.
+ */
+static int scull_set_default(bool quantum, unsigned long val, int *old) {
+    int *def = quantum ? &scull_quantum : &scull_qset;
+    long size;
+
+    /* Tell and sHift pass the value itself, any unsigned long */
+    if (val == 0 || val > INT_MAX) {
+        return -EINVAL;
+    }
+    mutex_lock(&scull_defaults_lock);
+    if (old) {
+        *old = *def;
+    }
+    size = (long)val * (quantum ? scull_qset : scull_quantum);
+    if (size <= INT_MAX) {
+        *def = val;
+    }
+    mutex_unlock(&scull_defaults_lock);
+    return size <= INT_MAX ? 0 : -EINVAL;
+}
+
+long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
+    int retval = 0, tmp, val;
+
+    /*
+     * extract the type and number bitfields, and don't decode
+     * wrong cmds: return ENOTTY (inappropriate ioctl) before access_ok()
+     */
+    if (_IOC_TYPE(cmd) != SCULL_IOC_MAGIC) {
+        return -ENOTTY;
+    }
+    if (_IOC_NR(cmd) > SCULL_IOC_MAXNR) {
+        return -ENOTTY;
+    }
+
+    switch (cmd) {
+        case SCULL_IOCRESET:
+            mutex_lock(&scull_defaults_lock);
+            scull_quantum = SCULL_QUANTUM;
+            scull_qset    = SCULL_QSET;
+            mutex_unlock(&scull_defaults_lock);
+            break;
+
+        case SCULL_IOCSQUANTUM: /* Set: arg points to the value */
+        case SCULL_IOCSQSET:
+            if (!capable(CAP_SYS_ADMIN)) {
+                return -EPERM;
+            }
+            if (get_user(val, (int __user *)arg)) {
+                return -EFAULT;
+            }
+            /* a negative value is past INT_MAX as an unsigned long */
+            retval = scull_set_default(cmd == SCULL_IOCSQUANTUM, val, NULL);
+            break;
+
+        case SCULL_IOCTQUANTUM: /* Tell: arg is the value */
+            if (!capable(CAP_SYS_ADMIN)) {
+                return -EPERM;
+            }
+            retval = scull_set_default(true, arg, NULL);
+            break;
+
+        case SCULL_IOCTQSET:
+            if (!capable(CAP_SYS_ADMIN)) {
+                return -EPERM;
+            }
+            retval = scull_set_default(false, arg, NULL);
+            break;
+
+        case SCULL_IOCGQUANTUM: /* Get: arg is pointer to result */
+            retval = put_user(scull_quantum, (int __user *)arg);
+            break;
+
+        case SCULL_IOCGQSET:
+            retval = put_user(scull_qset, (int __user *)arg);
+            break;
+
+        case SCULL_IOCQQUANTUM: /* Query: return it (it's positive) */
+            return scull_quantum;
+
+        case SCULL_IOCQQSET:
+            return scull_qset;
+
+        case SCULL_IOCXQUANTUM: /* eXchange: use arg as pointer */
+        case SCULL_IOCXQSET:
+            if (!capable(CAP_SYS_ADMIN)) {
+                return -EPERM;
+            }
+            if (get_user(val, (int __user *)arg)) {
+                return -EFAULT;
+            }
+            retval = scull_set_default(cmd == SCULL_IOCXQUANTUM, val, &tmp);
+            if (retval == 0) {
+                retval = put_user(tmp, (int __user *)arg);
+            }
+            break;
+
+        case SCULL_IOCHQUANTUM: /* sHift: like Tell + Query */
+            if (!capable(CAP_SYS_ADMIN)) {
+                return -EPERM;
+            }
+            retval = scull_set_default(true, arg, &tmp);
+            return retval ? retval : tmp;
+
+        case SCULL_IOCHQSET:
+            if (!capable(CAP_SYS_ADMIN)) {
+                return -EPERM;
+            }
+            retval = scull_set_default(false, arg, &tmp);
+            return retval ? retval : tmp;
+
+        /* the pipe buffer size belongs to 09-scull_pipe */
+        case SCULL_P_IOCTSIZE:
+        case SCULL_P_IOCQSIZE:
+            return -ENOTTY;
+
+        default: /* redundant, as cmd was checked against MAXNR */
+            return -ENOTTY;
+    }
+
+    return retval;
+}